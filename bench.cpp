@@ -0,0 +1,435 @@
+/*
+ * Codec benchmark
+ *
+ * Times the kernels of all three tools on the same input: text RLE
+ * (rle.cpp), binary RLE in formats 3 and 5 (rle_binary.cpp), and the
+ * histogram, tree build, encode and decode stages of the Huffman compressor
+ * (project.cpp). Every kernel runs once per block size and thread count; each
+ * thread works through its own copy of the block for at least --min-time
+ * seconds. The input is a file or a synthetic corpus (see corpus.h).
+ * Reported per row: throughput in MB/s over all threads, TSC cycles per byte
+ * per thread (x86 only, else 0), and heap allocations per call.
+ *
+ * The tools are single source files with their own main, so each is included
+ * here inside a namespace of its own. Build from the repository root:
+ *
+ *   g++ -O2 -std=c++17 -pthread bench.cpp -o bench
+ */
+
+// Everything the tools include, so their #includes below are no-ops and only
+// their own code lands in the namespaces
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include <queue>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <new>
+#include "huffman_tables.h"
+#include "corpus.h"
+#include "tooling.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rle_text
+{
+#include "rle.cpp"
+}
+
+namespace rle_binary
+{
+#include "rle_binary.cpp"
+}
+
+// huffman_tables.h is already included above, so project.cpp sees the global tables
+namespace huffman
+{
+#include "project.cpp"
+}
+
+using namespace std;
+
+/*
+ * Allocation counting
+ *
+ * The global allocation functions are replaced with counting versions, so
+ * any new (including those of std containers) is seen.
+ */
+atomic<uint64_t> allocCount{0};
+atomic<uint64_t> allocBytes{0};
+
+#if defined(__GNUC__) && !defined(__clang__)
+// GCC pairs the malloc inside operator new with the free inside operator delete
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size)
+{
+    allocCount.fetch_add(1, memory_order_relaxed);
+    allocBytes.fetch_add(size, memory_order_relaxed);
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// Cycle counter, or 0 where there is none
+inline uint64_t readCycles()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Kernel results go here so the calls are not optimized away
+volatile size_t sink;
+
+// One kernel prepared for a block: run() is what gets timed
+struct Kernel
+{
+    string name;
+    function<void()> run;
+};
+
+// One row of results
+struct Result
+{
+    string kernel;
+    size_t blockSize;
+    size_t threads;
+    uint64_t calls;
+    double seconds;
+    double mbPerSec;
+    double cyclesPerByte;
+    double allocsPerCall;
+    double allocBytesPerCall;
+};
+
+// Build the kernels for one block. Inputs of the decode kernels are made here,
+// outside the timed region
+vector<Kernel> makeKernels(const vector<unsigned char> &block)
+{
+    // Digits in the input would be read back as run counts by the text format,
+    // so its kernels see them as letters
+    auto text = make_shared<string>(block.begin(), block.end());
+    for (char &c : *text)
+    {
+        if (c >= '0' && c <= '9')
+            c = static_cast<char>(c - '0' + 'A');
+    }
+    auto textEncoded = make_shared<string>(rle_text::rleCompress(*text));
+    auto binary = make_shared<vector<uint8_t>>(block.begin(), block.end());
+    auto escapeEncoded = make_shared<vector<uint8_t>>(rle_binary::rleCompressBinary(*binary, rle_binary::FORMAT_ADAPTIVE_ESCAPE));
+    auto packBitsEncoded = make_shared<vector<uint8_t>>(rle_binary::rleCompressBinary(*binary, rle_binary::FORMAT_PACKBITS));
+
+    auto data = make_shared<vector<unsigned char>>(block);
+    auto freq = make_shared<unordered_map<unsigned char, int>>(huffman::buildHistogram(*data));
+    auto codes = make_shared<unordered_map<unsigned char, string>>(huffman::buildBlockCodes(*freq));
+    ostringstream encoded;
+    huffman::writeHuffmanBlock(encoded, *data, *codes, true);
+    auto huffmanEncoded = make_shared<string>(encoded.str());
+
+    return {
+        {"text.compress", [=]
+         { sink = rle_text::rleCompress(*text).size(); }},
+        {"text.decompress", [=]
+         { sink = rle_text::rleDecompress(*textEncoded).size(); }},
+        {"binary3.compress", [=]
+         { sink = rle_binary::rleCompressBinary(*binary, rle_binary::FORMAT_ADAPTIVE_ESCAPE).size(); }},
+        {"binary3.decompress", [=]
+         { sink = rle_binary::rleDecompressBinary(*escapeEncoded).size(); }},
+        {"binary5.compress", [=]
+         { sink = rle_binary::rleCompressBinary(*binary, rle_binary::FORMAT_PACKBITS).size(); }},
+        {"binary5.decompress", [=]
+         { sink = rle_binary::rleDecompressBinary(*packBitsEncoded).size(); }},
+        {"huffman.histogram", [=]
+         { sink = huffman::buildHistogram(*data).size(); }},
+        {"huffman.tree", [=]
+         { sink = huffman::buildBlockCodes(*freq).size(); }},
+        {"huffman.encode", [=]
+         {
+             ostringstream out;
+             huffman::writeHuffmanBlock(out, *data, *codes, true);
+             sink = static_cast<size_t>(out.tellp());
+         }},
+        {"huffman.decode", [=]
+         {
+             istringstream in(*huffmanEncoded);
+             uint32_t bitLength = 0;
+             huffman::readValue(in, bitLength);
+             sink = huffman::decodeBlock(in, bitLength).size();
+         }},
+    };
+}
+
+// Run a kernel on the given number of threads for at least minTime seconds.
+// Every thread builds its own kernel from its own copy of the block
+Result measure(const string &name, const vector<unsigned char> &block, size_t threads, double minTime)
+{
+    vector<Kernel> perThread;
+    for (size_t t = 0; t < threads; t++)
+    {
+        for (Kernel &k : makeKernels(block))
+        {
+            if (k.name == name)
+                perThread.push_back(move(k));
+        }
+    }
+
+    atomic<uint64_t> calls{0};
+    atomic<bool> start{false};
+    auto worker = [&](Kernel &k)
+    {
+        while (!start)
+            this_thread::yield();
+        auto begin = chrono::steady_clock::now();
+        uint64_t n = 0;
+        do
+        {
+            k.run();
+            n++;
+        } while (chrono::duration<double>(chrono::steady_clock::now() - begin).count() < minTime);
+        calls += n;
+    };
+
+    vector<thread> workers;
+    for (Kernel &k : perThread)
+        workers.emplace_back(worker, ref(k));
+
+    uint64_t allocsBefore = allocCount, bytesBefore = allocBytes;
+    uint64_t cyclesBefore = readCycles();
+    auto begin = chrono::steady_clock::now();
+    start = true;
+    for (thread &t : workers)
+        t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    uint64_t cycles = readCycles() - cyclesBefore;
+
+    Result r;
+    r.kernel = name;
+    r.blockSize = block.size();
+    r.threads = threads;
+    r.calls = calls;
+    r.seconds = seconds;
+    double bytes = static_cast<double>(r.calls) * block.size();
+    r.mbPerSec = bytes / seconds / 1e6;
+    r.cyclesPerByte = static_cast<double>(cycles) * threads / bytes;
+    r.allocsPerCall = static_cast<double>(allocCount - allocsBefore) / r.calls;
+    r.allocBytesPerCall = static_cast<double>(allocBytes - bytesBefore) / r.calls;
+    return r;
+}
+
+// Parse a comma-separated list of byte counts with optional k/m/g suffixes
+vector<size_t> parseSizeList(const string &text)
+{
+    vector<size_t> sizes;
+    stringstream list(text);
+    string item;
+    while (getline(list, item, ','))
+    {
+        size_t size = parseSize(item);
+        if (size == 0)
+            return {};
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+void printCsv(const vector<Result> &results)
+{
+    cout << "kernel,block_size,threads,calls,seconds,mb_per_s,cycles_per_byte,allocs_per_call,alloc_bytes_per_call\n";
+    for (const Result &r : results)
+    {
+        cout << r.kernel << ',' << r.blockSize << ',' << r.threads << ',' << r.calls << ',' << r.seconds << ','
+             << r.mbPerSec << ',' << r.cyclesPerByte << ',' << r.allocsPerCall << ',' << r.allocBytesPerCall << '\n';
+    }
+}
+
+void printJson(const vector<Result> &results)
+{
+    cout << "[\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        cout << "  {\"kernel\": \"" << r.kernel << "\", \"block_size\": " << r.blockSize
+             << ", \"threads\": " << r.threads << ", \"calls\": " << r.calls << ", \"seconds\": " << r.seconds
+             << ", \"mb_per_s\": " << r.mbPerSec << ", \"cycles_per_byte\": " << r.cyclesPerByte
+             << ", \"allocs_per_call\": " << r.allocsPerCall << ", \"alloc_bytes_per_call\": " << r.allocBytesPerCall
+             << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    cout << "]\n";
+}
+
+void printUsage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [options] [input]\n"
+         << "Options:\n"
+         << "  --kernel <name>       run only kernels whose name starts with name (repeatable)\n"
+         << "  --block-sizes <list>  comma-separated block sizes, k/m suffix allowed (default 64k,1m)\n"
+         << "  --threads <list>      comma-separated thread counts (default 1 and all cores)\n"
+         << "  --min-time <s>        seconds per measurement (default 0.5)\n"
+         << "  --json                JSON instead of CSV\n"
+         << "  --profile <name>      synthetic input profile from corpus.h (default mixed)\n"
+         << "  --seed <n>            seed of the synthetic input (default 1)\n"
+         << "Without an input file a synthetic one is generated; a file shorter than a\n"
+         << "block is repeated to fill it.\n";
+}
+
+int main(int argc, char *argv[])
+{
+    vector<size_t> blockSizes = {64 << 10, 1 << 20};
+    vector<size_t> threadCounts = {1};
+    if (thread::hardware_concurrency() > 1)
+        threadCounts.push_back(thread::hardware_concurrency());
+    vector<string> filters;
+    double minTime = 0.5;
+    bool json = false;
+    string input;
+    string profile = "mixed";
+    uint64_t seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--kernel" && i + 1 < argc)
+        {
+            filters.push_back(argv[++i]);
+        }
+        else if (arg == "--block-sizes" && i + 1 < argc)
+        {
+            blockSizes = parseSizeList(argv[++i]);
+            if (blockSizes.empty())
+            {
+                cerr << "Invalid block sizes: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            threadCounts = parseSizeList(argv[++i]);
+            if (threadCounts.empty())
+            {
+                cerr << "Invalid thread counts: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--min-time" && i + 1 < argc)
+        {
+            minTime = atof(argv[++i]);
+            if (minTime <= 0)
+            {
+                cerr << "Invalid time: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--profile" && i + 1 < argc)
+        {
+            profile = argv[++i];
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--json")
+        {
+            json = true;
+        }
+        else if (input.empty() && arg[0] != '-')
+        {
+            input = arg;
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return 2;
+        }
+    }
+
+    size_t largest = *max_element(blockSizes.begin(), blockSizes.end());
+    vector<unsigned char> source;
+    if (input.empty())
+    {
+        if (!generateCorpus(profile, largest, seed, source))
+        {
+            cerr << "Unknown profile: " << profile << endl;
+            return 2;
+        }
+    }
+    else
+    {
+        ifstream in(input, ios::binary);
+        source.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        if (!in || source.empty())
+        {
+            cerr << "Error: Cannot read input: " << input << endl;
+            return 1;
+        }
+        for (size_t i = 0; source.size() < largest; i++)
+            source.push_back(source[i]);
+    }
+
+    vector<Result> results;
+    for (size_t blockSize : blockSizes)
+    {
+        vector<unsigned char> block(source.begin(), source.begin() + blockSize);
+        for (const Kernel &k : makeKernels(block))
+        {
+            bool selected = filters.empty();
+            for (const string &f : filters)
+                selected = selected || k.name.compare(0, f.size(), f) == 0;
+            if (!selected)
+                continue;
+            for (size_t threads : threadCounts)
+            {
+                results.push_back(measure(k.name, block, threads, minTime));
+                cerr << k.name << " block " << blockSize << " threads " << threads << ": " << fixed
+                     << setprecision(1) << results.back().mbPerSec << " MB/s" << defaultfloat << endl;
+            }
+        }
+    }
+
+    if (json)
+        printJson(results);
+    else
+        printCsv(results);
+    return 0;
+}
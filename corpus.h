@@ -0,0 +1,177 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * Synthetic corpora
+ *
+ * Seeded generators for the data shapes the codecs are tuned for:
+ *
+ *   runs    byte runs of 1 to 4096, over a 16-value alphabet
+ *   skewed  independent bytes, each value half as likely as the one before
+ *   random  uniform bytes (incompressible)
+ *   text    UTF-8 words with Zipf-like frequencies, mostly ASCII with
+ *           Latin, Greek, CJK and emoji words mixed in
+ *   sparse  an 8-bit raster of mostly zero rows with noisy rectangles, and
+ *           zero spans of 64 KiB and more between frames
+ *   mixed   segments of 4 KiB to 256 KiB of the other profiles
+ *
+ * The output depends only on profile, size and seed: the generators use the
+ * raw mt19937_64 sequence (which the standard fixes) and no std
+ * distributions (which differ between library implementations).
+ */
+
+const char *const CORPUS_PROFILES[] = {"runs", "skewed", "random", "text", "sparse", "mixed"};
+
+// Uniform value in [0, n)
+inline uint64_t corpusPick(std::mt19937_64 &rng, uint64_t n)
+{
+    return rng() % n;
+}
+
+// Value in [0, 64) where each is half as likely as the one before
+inline unsigned corpusHalving(std::mt19937_64 &rng)
+{
+    uint64_t bits = rng();
+    unsigned v = 0;
+    while (v < 63 && (bits >> v & 1) == 0)
+        v++;
+    return v;
+}
+
+inline void generateRuns(std::mt19937_64 &rng, std::vector<unsigned char> &out, size_t size)
+{
+    while (out.size() < size)
+    {
+        // Lengths spread over powers of two, so short and long runs both occur
+        size_t length = 1 + corpusPick(rng, size_t(1) << corpusPick(rng, 13));
+        length = std::min(length, size - out.size());
+        out.insert(out.end(), length, static_cast<unsigned char>(corpusPick(rng, 16) * 17));
+    }
+}
+
+inline void generateSkewed(std::mt19937_64 &rng, std::vector<unsigned char> &out, size_t size)
+{
+    // A fixed shuffle of byte values, so the common ones are not just 0, 1, 2...
+    unsigned char order[256];
+    for (int i = 0; i < 256; i++)
+        order[i] = static_cast<unsigned char>(i * 167 + 13);
+    while (out.size() < size)
+        out.push_back(order[corpusHalving(rng) * 4 + corpusPick(rng, 4)]);
+}
+
+inline void generateRandom(std::mt19937_64 &rng, std::vector<unsigned char> &out, size_t size)
+{
+    while (out.size() < size)
+    {
+        uint64_t word = rng();
+        for (size_t i = std::min<size_t>(8, size - out.size()); i > 0; i--, word >>= 8)
+            out.push_back(static_cast<unsigned char>(word));
+    }
+}
+
+inline void generateText(std::mt19937_64 &rng, std::vector<unsigned char> &out, size_t size)
+{
+    static const char *const words[] = {
+        "the", "of", "and", "to", "in", "is", "data", "file", "block", "run", "that", "for", "with", "as",
+        "compression", "stream", "value", "table", "café", "naïve", "über", "straße", "résumé", "λόγος",
+        "δεδομένα", "数据", "压缩", "ファイル", "🙂", "✓"};
+    const size_t count = sizeof(words) / sizeof(words[0]);
+    size_t line = 0;
+    while (true)
+    {
+        // Halving picks make the first words by far the most frequent
+        const char *word = words[std::min<size_t>(corpusHalving(rng) * 3 + corpusPick(rng, 3), count - 1)];
+        size_t length = strlen(word);
+        if (out.size() + length + 1 > size)
+            break;
+        out.insert(out.end(), word, word + length);
+        line += length + 1;
+        char separator = ' ';
+        if (line > 60 + corpusPick(rng, 20))
+        {
+            separator = '\n';
+            line = 0;
+        }
+        else if (corpusPick(rng, 12) == 0)
+            separator = ',';
+        out.push_back(static_cast<unsigned char>(separator));
+    }
+    // Pad with newlines rather than cut a multi-byte character
+    out.resize(size, '\n');
+}
+
+inline void generateSparse(std::mt19937_64 &rng, std::vector<unsigned char> &out, size_t size)
+{
+    const size_t width = 1024, height = 256;
+    while (out.size() < size)
+    {
+        // One frame: zero background with a few noisy rectangles
+        std::vector<unsigned char> frame(width * height, 0);
+        for (uint64_t r = corpusPick(rng, 6); r > 0; r--)
+        {
+            size_t x = corpusPick(rng, width), y = corpusPick(rng, height);
+            size_t w = 1 + corpusPick(rng, width - x), h = 1 + corpusPick(rng, height - y);
+            unsigned char shade = static_cast<unsigned char>(32 + corpusPick(rng, 224));
+            for (size_t row = y; row < y + h; row++)
+                for (size_t col = x; col < x + w; col++)
+                    frame[row * width + col] = static_cast<unsigned char>(shade + corpusPick(rng, 4));
+        }
+        out.insert(out.end(), frame.begin(), frame.begin() + std::min(frame.size(), size - out.size()));
+
+        // A gap of 64 KiB to 1 MiB between frames
+        size_t gap = (size_t(1) << 16) * (1 + corpusPick(rng, 16));
+        out.insert(out.end(), std::min(gap, size - out.size()), 0);
+    }
+}
+
+inline bool generateProfile(const std::string &profile, std::mt19937_64 &rng, std::vector<unsigned char> &out,
+                            size_t size);
+
+inline void generateMixed(std::mt19937_64 &rng, std::vector<unsigned char> &out, size_t size)
+{
+    while (out.size() < size)
+    {
+        size_t length = std::min<size_t>((size_t(4) << 10) << corpusPick(rng, 7), size - out.size());
+        generateProfile(CORPUS_PROFILES[corpusPick(rng, 5)], rng, out, out.size() + length);
+    }
+}
+
+// Append data of the profile to out until it holds size bytes; false if the
+// profile is unknown
+inline bool generateProfile(const std::string &profile, std::mt19937_64 &rng, std::vector<unsigned char> &out,
+                            size_t size)
+{
+    if (profile == "runs")
+        generateRuns(rng, out, size);
+    else if (profile == "skewed")
+        generateSkewed(rng, out, size);
+    else if (profile == "random")
+        generateRandom(rng, out, size);
+    else if (profile == "text")
+        generateText(rng, out, size);
+    else if (profile == "sparse")
+        generateSparse(rng, out, size);
+    else if (profile == "mixed")
+        generateMixed(rng, out, size);
+    else
+        return false;
+    return true;
+}
+
+// size bytes of the profile for the seed; false if the profile is unknown
+inline bool generateCorpus(const std::string &profile, size_t size, uint64_t seed, std::vector<unsigned char> &out)
+{
+    std::mt19937_64 rng(seed);
+    out.clear();
+    out.reserve(size);
+    return generateProfile(profile, rng, out, size);
+}
+
+#endif
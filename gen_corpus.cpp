@@ -0,0 +1,140 @@
+#include <iostream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include "corpus.h"
+#include "tooling.h"
+
+using namespace std;
+
+/*
+ * Benchmark corpus generator
+ *
+ * Writes seeded synthetic files of the profiles in corpus.h. The same
+ * profile, size and seed always give the same bytes. Zero spans of
+ * HOLE_MIN_SIZE or more are skipped with a seek, so on file systems with
+ * sparse file support they become holes.
+ */
+const size_t HOLE_MIN_SIZE = 1 << 15; // 32 KiB
+
+// Write data to file, leaving long zero spans as holes
+bool writeCorpus(const string &file, const vector<unsigned char> &data)
+{
+    ofstream out(file, ios::binary | ios::trunc);
+    if (!out)
+    {
+        cerr << "Error: Cannot create file: " << file << endl;
+        return false;
+    }
+
+    // Bytes from start to i are pending until a hole or the end is reached
+    size_t start = 0, i = 0;
+    while (i < data.size())
+    {
+        if (data[i] != 0)
+        {
+            i++;
+            continue;
+        }
+        size_t zeros = 0;
+        while (i + zeros < data.size() && data[i + zeros] == 0)
+            zeros++;
+        if (zeros >= HOLE_MIN_SIZE)
+        {
+            out.write(reinterpret_cast<const char *>(data.data() + start), i - start);
+            out.seekp(static_cast<streamoff>(zeros), ios::cur);
+            start = i + zeros;
+        }
+        i += zeros;
+    }
+    out.write(reinterpret_cast<const char *>(data.data() + start), i - start);
+    out.close();
+
+    // Give the file its full length in case it ends in a hole
+    error_code ec;
+    filesystem::resize_file(file, data.size(), ec);
+    if (!out || ec)
+    {
+        cerr << "Error: Failed to write file: " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+void printUsage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [options] <profile> <file>\n"
+         << "   or: " << prog << " [options] all <dir>   (writes <dir>/<profile>.bin for every profile)\n"
+         << "Options:\n"
+         << "  --size <n>   bytes per file, k/m/g suffix allowed (default 16m)\n"
+         << "  --seed <n>   random seed (default 1)\n"
+         << "Profiles:";
+    for (const char *profile : CORPUS_PROFILES)
+        cerr << " " << profile;
+    cerr << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+    size_t size = 16 << 20;
+    uint64_t seed = 1;
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--size" && i + 1 < argc)
+        {
+            size = parseSize(argv[++i]);
+            if (size == 0)
+            {
+                cerr << "Invalid size: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else if (arg == "--seed" && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() != 2)
+    {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    vector<pair<string, string>> jobs;
+    if (args[0] == "all")
+    {
+        error_code ec;
+        filesystem::create_directories(args[1], ec);
+        for (const char *profile : CORPUS_PROFILES)
+            jobs.emplace_back(profile, (filesystem::path(args[1]) / (string(profile) + ".bin")).string());
+    }
+    else
+    {
+        jobs.emplace_back(args[0], args[1]);
+    }
+
+    vector<unsigned char> data;
+    for (const auto &[profile, file] : jobs)
+    {
+        if (!generateCorpus(profile, size, seed, data))
+        {
+            cerr << "Unknown profile: " << profile << endl;
+            printUsage(argv[0]);
+            return 2;
+        }
+        if (!writeCorpus(file, data))
+            return 1;
+        cout << profile << " -> " << file << " (" << data.size() << " bytes, seed " << seed << ")" << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef HUFFMAN_TABLES_H
+#define HUFFMAN_TABLES_H
+
+#include <cstdint>
+
+/*
+ * Built-in canonical Huffman tables
+ *
+ * Each table holds a code length for all 256 byte values, so any block can be
+ * coded with it. Lengths were built from smoothed byte histograms of sample
+ * content, limited to 15 bits, and form a complete prefix code. Table IDs
+ * are written into the compressed stream: never reorder or change a table,
+ * only append new ones.
+ */
+
+struct StaticHuffmanTable
+{
+    const char *name;
+    uint8_t lengths[256];
+};
+
+constexpr StaticHuffmanTable STATIC_TABLES[] = {
+    // UTF-8 text, including Turkish (derived from test.docx)
+    {"utf8-text",
+     {15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  7, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+       3, 15, 15, 15, 15, 15, 15, 15,  8,  8, 15, 11,  7,  8,  7, 10,
+      15,  9, 10, 11, 12, 11, 15, 15, 15, 12,  9, 15, 10, 15, 10, 15,
+      15,  9, 10, 12,  9, 15, 15,  9,  9, 10, 15, 10, 10, 10, 15, 15,
+       8, 15, 11,  9, 11, 10, 12, 15, 15, 12, 11, 15, 15, 15, 15, 10,
+      15,  4,  7,  8,  5,  4,  7,  7,  8,  4,  9,  5,  4,  5,  5,  5,
+       8, 15,  4,  5,  5,  6,  7, 12, 15,  6,  8, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 11, 15, 15, 15, 15, 15, 15, 15, 15,  6,
+      15, 15, 15, 15, 15, 15, 15,  7, 15, 15, 15, 15, 15, 15, 15, 15,
+      15,  4, 15, 15, 15, 15,  9, 15, 15, 15, 15, 15,  7, 15, 15, 15,
+      15, 15, 15,  6,  4,  6, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 14, 14, 14, 14, 14, 14}},
+    // English prose (derived from common license texts)
+    {"english",
+     {15, 15, 15, 15, 15, 15, 15, 15, 15, 12,  6, 15, 14, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+       3, 15,  9, 15, 15, 15, 15, 11,  9,  9,  8, 15,  7,  8,  7, 11,
+      11, 10, 11, 11, 13, 12, 12, 13, 13, 12, 11, 11, 13, 12, 13, 15,
+      15,  9, 11,  8,  9,  8,  9, 10, 10,  8, 15, 14,  8, 10,  9,  9,
+       9, 15,  9,  8,  8, 10, 11, 10, 13,  9, 15, 15, 15, 15, 15, 15,
+      15,  4,  6,  5,  5,  4,  6,  6,  5,  4, 11,  8,  5,  6,  4,  4,
+       6, 10,  4,  4,  4,  5,  7,  7,  9,  6, 12, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 14}},
+    // JSON documents and schemas
+    {"json",
+     {15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  6, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+       2, 14,  3, 11, 12,  9, 14, 13, 12, 12, 13, 13,  5, 10,  8,  7,
+       9, 10, 10, 11, 11, 11, 12, 11, 10, 11,  4, 14, 15, 13, 15, 11,
+      12, 12, 11, 11, 12, 12, 12, 15, 14, 13, 15, 15, 13, 13, 14, 13,
+      13, 15, 13, 12, 12, 13, 15, 15, 15, 15, 15, 11, 10, 11, 15,  6,
+      12,  5,  7,  6,  6,  4,  7,  7,  6,  6, 11,  8,  6,  6,  5,  5,
+       6, 11,  5,  5,  4,  7,  7,  8,  9,  7, 12,  7, 13,  7, 14, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+      15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15}},
+    // x86-64 machine code (.text of a typical ELF binary)
+    {"x86-code",
+     { 3,  6,  8,  8,  7,  6,  8,  8,  7,  8,  8,  8,  8,  8,  9,  5,
+       7, 10, 10, 10,  9,  8, 10, 10,  8, 10, 11, 10, 10,  9, 11,  6,
+       8, 11, 10, 10,  6,  9, 11, 10,  8,  9, 10,  9, 10,  9,  9, 10,
+       9,  7, 11, 11, 10,  8, 11, 11,  9,  8, 11, 10,  9,  8, 11, 10,
+       8,  6, 10,  9,  6,  8, 10, 10,  4,  7, 10, 10,  6,  8, 11, 11,
+      10, 11, 11,  9,  8,  8, 10, 10, 10, 11, 11,  8,  8,  8, 10, 10,
+      10, 11, 11,  8,  9, 11,  7, 11, 10, 11, 11, 11, 10, 11, 11, 10,
+      10, 11, 11, 10,  7,  8, 10, 10,  9, 11, 11, 10,  8,  9,  9,  9,
+       7,  9, 11,  6,  6,  6, 10, 10,  9,  5, 11,  5, 11,  7, 10, 10,
+       9, 11, 11, 11, 10, 10, 11, 11, 10, 11, 11, 11, 11, 11, 11, 11,
+      11, 11, 11, 11, 11, 11, 11, 11, 10, 11, 11, 11, 11, 11, 11, 11,
+      11, 11, 11, 11, 11, 11,  8, 10,  9, 10,  9, 10, 10, 10,  9,  9,
+       6,  9,  9,  7,  8,  8,  8,  7, 10,  9, 10, 11, 11, 11, 11, 10,
+       9, 10,  8, 10, 11, 10, 10, 10,  9, 11, 10,  9, 11, 10,  9,  8,
+       9, 10, 10, 10,  9, 10, 10,  9,  5,  7, 10,  8,  9,  9,  9,  8,
+      10, 10, 10, 10,  9,  9,  7,  8,  8,  9,  8,  8,  8,  8,  7,  4}}
+};
+
+// Table IDs are 1-based in the stream; 0 means the block carries its own table
+constexpr int STATIC_TABLE_COUNT = sizeof(STATIC_TABLES) / sizeof(STATIC_TABLES[0]);
+
+#endif
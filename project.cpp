@@ -7,6 +7,22 @@
 #include <algorithm>
 #include <iomanip>
 #include <string>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <filesystem>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include "huffman_tables.h"
+#include "tooling.h"
 using namespace std;
 
 // Huffman Tree Node
@@ -75,7 +91,7 @@ void buildCodes(Node *node, const string &prefix, unordered_map<unsigned char, s
 }
 
 // Write bits to file using buffer
-void writeBits(ofstream &out, const string &bits, uint8_t &buffer, int &count)
+void writeBits(ostream &out, const string &bits, uint8_t &buffer, int &count)
 {
     for (char b : bits)
     {
@@ -93,7 +109,7 @@ void writeBits(ofstream &out, const string &bits, uint8_t &buffer, int &count)
 }
 
 // Flush remaining bits
-void flushBits(ofstream &out, uint8_t &buffer, int &count)
+void flushBits(ostream &out, uint8_t &buffer, int &count)
 {
     if (count > 0)
     {
@@ -105,7 +121,7 @@ void flushBits(ofstream &out, uint8_t &buffer, int &count)
 }
 
 // Save canonical Huffman table
-void saveCanonicalTable(ofstream &out, const unordered_map<unsigned char, string> &codes)
+void saveCanonicalTable(ostream &out, const unordered_map<unsigned char, string> &codes)
 {
     uint16_t tableSize = codes.size();
     out.write(reinterpret_cast<char *>(&tableSize), sizeof(tableSize));
@@ -123,25 +139,40 @@ void saveCanonicalTable(ofstream &out, const unordered_map<unsigned char, string
     }
 }
 
-// Load canonical Huffman table and reconstruct codes
-unordered_map<unsigned char, string> loadCanonicalTable(ifstream &in)
+// Load canonical Huffman table and reconstruct codes; on a truncated or
+// impossible table the stream is marked failed and no codes are returned
+unordered_map<unsigned char, string> loadCanonicalTable(istream &in)
 {
     unordered_map<unsigned char, string> codes;
-    uint16_t tableSize;
+    uint16_t tableSize = 0;
     in.read(reinterpret_cast<char *>(&tableSize), sizeof(tableSize));
+    if (!in || tableSize > 256)
+    {
+        in.setstate(ios::failbit);
+        return codes;
+    }
 
     vector<pair<unsigned char, uint8_t>> table(tableSize);
     for (int i = 0; i < tableSize; i++)
     {
         table[i] = {static_cast<unsigned char>(in.get()), static_cast<uint8_t>(in.get())};
     }
+    if (!in)
+        return codes;
     sort(table.begin(), table.end(), [](auto &a, auto &b)
          { return a.second == b.second ? a.first < b.first : a.second < b.second; });
 
-    uint32_t code = 0;
+    uint64_t code = 0;
     uint8_t prevLen = 0;
     for (auto &[c, len] : table)
     {
+        // Every length must leave room for its code, or the table cannot be a prefix code
+        if (len == 0 || len >= 64 || (code << (len - prevLen)) >> len != 0)
+        {
+            in.setstate(ios::failbit);
+            codes.clear();
+            return codes;
+        }
         code <<= (len - prevLen);
         string codeStr;
         for (int i = len - 1; i >= 0; i--)
@@ -153,18 +184,41 @@ unordered_map<unsigned char, string> loadCanonicalTable(ifstream &in)
     return codes;
 }
 
-// Build canonical codes from code lengths
-unordered_map<unsigned char, string> makeCanonicalCodes(const unordered_map<unsigned char, string> &codes)
+// Build a decoding tree from canonical codes
+Node *buildDecodeTree(const unordered_map<unsigned char, string> &codes)
 {
-    vector<pair<unsigned char, uint8_t>> table;
+    Node *root = new Node('\0', 0);
     for (auto &[c, code] : codes)
-        table.push_back({c, static_cast<uint8_t>(code.size())});
+    {
+        Node *node = root;
+        for (char b : code)
+        {
+            if (b == '1')
+            {
+                if (!node->left)
+                    node->left = new Node('\0', 0);
+                node = node->left;
+            }
+            else
+            {
+                if (!node->right)
+                    node->right = new Node('\0', 0);
+                node = node->right;
+            }
+        }
+        node->ch = c;
+    }
+    return root;
+}
 
+// Assign canonical codes to (symbol, length) pairs
+unordered_map<unsigned char, string> canonicalCodesFromLengths(vector<pair<unsigned char, uint8_t>> table)
+{
     sort(table.begin(), table.end(), [](auto &a, auto &b)
          { return a.second == b.second ? a.first < b.first : a.second < b.second; });
 
     unordered_map<unsigned char, string> canonical;
-    uint32_t codeVal = 0;
+    uint64_t codeVal = 0;
     uint8_t prevLen = 0;
     for (auto &[c, len] : table)
     {
@@ -180,209 +234,2379 @@ unordered_map<unsigned char, string> makeCanonicalCodes(const unordered_map<unsi
     return canonical;
 }
 
-// Get file size without moving the stream on return
-uint64_t getFileSize(ifstream &in)
+// Build canonical codes from code lengths
+unordered_map<unsigned char, string> makeCanonicalCodes(const unordered_map<unsigned char, string> &codes)
 {
-    auto current = in.tellg();
-    in.seekg(0, ios::end);
-    auto endPos = in.tellg();
-    in.seekg(current, ios::beg);
-    if (endPos == static_cast<streampos>(-1))
-        return 0;
-    return static_cast<uint64_t>(endPos);
+    vector<pair<unsigned char, uint8_t>> table;
+    for (auto &[c, code] : codes)
+        table.push_back({c, static_cast<uint8_t>(code.size())});
+    return canonicalCodesFromLengths(table);
 }
 
-// Compress file in chunks
-void compressFile(const string &inputFile, const string &outputFile, size_t blockSize = 1 << 20)
+// Count byte frequencies of a block
+unordered_map<unsigned char, int> buildHistogram(const vector<unsigned char> &data)
 {
-    ifstream in(inputFile, ios::binary);
-    ofstream out(outputFile, ios::binary);
-    if (!in || !out)
-    {
-        cerr << "Error opening files!\n";
-        return;
-    }
+    int counts[256] = {};
+    for (unsigned char c : data)
+        counts[c]++;
+    unordered_map<unsigned char, int> freq;
+    for (int c = 0; c < 256; c++)
+        if (counts[c] > 0)
+            freq[static_cast<unsigned char>(c)] = counts[c];
+    return freq;
+}
 
-    uint64_t totalBytes = getFileSize(in);
-    uint64_t processed = 0;
+// Lower bound on the cost of a block with its own table: entropy plus table bytes
+double estimateOptimalBits(const unordered_map<unsigned char, int> &freq)
+{
+    double total = 0;
+    for (auto &[c, f] : freq)
+        total += f;
+    double bits = 0;
+    for (auto &[c, f] : freq)
+        bits += f * log2(total / f);
+    return bits + 8.0 * (sizeof(uint16_t) + 2 * freq.size());
+}
 
-    while (!in.eof())
+// Codes of a built-in table, built once on first use
+const unordered_map<unsigned char, string> &staticTableCodes(int id)
+{
+    static const vector<unordered_map<unsigned char, string>> cache = []
     {
-        vector<unsigned char> block(blockSize);
-        in.read(reinterpret_cast<char *>(block.data()), blockSize);
-        size_t readBytes = in.gcount();
-        block.resize(readBytes);
-        if (readBytes == 0)
-            break;
+        vector<unordered_map<unsigned char, string>> tables;
+        for (const StaticHuffmanTable &t : STATIC_TABLES)
+        {
+            vector<pair<unsigned char, uint8_t>> lengths;
+            for (int c = 0; c < 256; c++)
+                lengths.push_back({static_cast<unsigned char>(c), t.lengths[c]});
+            tables.push_back(canonicalCodesFromLengths(lengths));
+        }
+        return tables;
+    }();
+    return cache[id - 1];
+}
 
-        unordered_map<unsigned char, int> freq;
-        for (unsigned char c : block)
-            freq[c]++;
+// Share of extra bits over the optimal code a built-in table may cost
+const double STATIC_TABLE_SLACK = 0.03;
 
-        Node *tree = buildHuffmanTree(freq);
-        unordered_map<unsigned char, string> codes;
-        buildCodes(tree, "", codes);
-        unordered_map<unsigned char, string> canonicalCodes = makeCanonicalCodes(codes);
+// Bits needed to code a block with a fixed table of code lengths
+double tableCost(const unordered_map<unsigned char, int> &freq, const uint8_t lengths[256])
+{
+    double bits = 0;
+    for (auto &[c, f] : freq)
+        bits += static_cast<double>(f) * lengths[c];
+    return bits;
+}
 
-        uint8_t buffer = 0;
-        int count = 0;
-        int bitLength = 0;
-        for (unsigned char c : block)
-            bitLength += canonicalCodes[c].size();
-        uint32_t bits = bitLength;
-        out.write(reinterpret_cast<char *>(&bits), sizeof(bits));
+// Pick the cheapest built-in table if it is within STATIC_TABLE_SLACK of the
+// optimal one; returns 0 when the block should carry its own table
+int chooseStaticTable(const unordered_map<unsigned char, int> &freq)
+{
+    double limit = estimateOptimalBits(freq) * (1.0 + STATIC_TABLE_SLACK);
+    int best = 0;
+    double bestBits = limit;
+    for (int id = 1; id <= STATIC_TABLE_COUNT; id++)
+    {
+        double bits = tableCost(freq, STATIC_TABLES[id - 1].lengths);
+        if (bits <= bestBits)
+        {
+            best = id;
+            bestBits = bits;
+        }
+    }
+    return best;
+}
 
-        saveCanonicalTable(out, canonicalCodes);
+// Induced-sorting suffix array construction (SA-IS), linear time.
+// s holds n symbols in [0, K) and must end with a unique smallest symbol 0.
+void buildSuffixArray(const int *s, int *SA, int n, int K)
+{
+    vector<bool> sType(n);
+    sType[n - 1] = true;
+    for (int i = n - 2; i >= 0; i--)
+        sType[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && sType[i + 1]);
+    auto isLMS = [&](int i)
+    { return i > 0 && sType[i] && !sType[i - 1]; };
 
-        for (unsigned char c : block)
-            writeBits(out, canonicalCodes[c], buffer, count);
-        flushBits(out, buffer, count);
+    vector<int> bkt(K);
+    auto getBuckets = [&](bool end)
+    {
+        fill(bkt.begin(), bkt.end(), 0);
+        for (int i = 0; i < n; i++)
+            bkt[s[i]]++;
+        int sum = 0;
+        for (int i = 0; i < K; i++)
+        {
+            sum += bkt[i];
+            bkt[i] = end ? sum : sum - bkt[i];
+        }
+    };
+    auto induce = [&]()
+    {
+        getBuckets(false);
+        for (int i = 0; i < n; i++)
+        {
+            int j = SA[i] - 1;
+            if (SA[i] > 0 && !sType[j])
+                SA[bkt[s[j]]++] = j;
+        }
+        getBuckets(true);
+        for (int i = n - 1; i >= 0; i--)
+        {
+            int j = SA[i] - 1;
+            if (SA[i] > 0 && sType[j])
+                SA[--bkt[s[j]]] = j;
+        }
+    };
 
-        freeTree(tree);
+    // Sort LMS substrings by placing LMS positions at bucket ends and inducing
+    getBuckets(true);
+    fill(SA, SA + n, -1);
+    for (int i = 1; i < n; i++)
+        if (isLMS(i))
+            SA[--bkt[s[i]]] = i;
+    induce();
 
-        processed += readBytes;
-        if (totalBytes > 0)
+    // Name the sorted LMS substrings to form the reduced problem
+    int n1 = 0;
+    for (int i = 0; i < n; i++)
+        if (isLMS(SA[i]))
+            SA[n1++] = SA[i];
+    fill(SA + n1, SA + n, -1);
+    int name = 0, prev = -1;
+    for (int i = 0; i < n1; i++)
+    {
+        int pos = SA[i];
+        bool diff = false;
+        for (int d = 0; d < n; d++)
+        {
+            if (prev == -1 || s[pos + d] != s[prev + d] || sType[pos + d] != sType[prev + d])
+            {
+                diff = true;
+                break;
+            }
+            if (d > 0 && (isLMS(pos + d) || isLMS(prev + d)))
+                break;
+        }
+        if (diff)
         {
-            double pct = (static_cast<double>(processed) * 100.0) / static_cast<double>(totalBytes);
-            if (pct > 100.0)
-                pct = 100.0;
-            cout << "\rCompressing: " << fixed << setprecision(1) << pct << "%" << flush;
+            name++;
+            prev = pos;
         }
+        SA[n1 + pos / 2] = name - 1;
     }
+    for (int i = n - 1, j = n - 1; i >= n1; i--)
+        if (SA[i] >= 0)
+            SA[j--] = SA[i];
 
-    in.close();
-    out.close();
-    if (totalBytes > 0)
-        cout << "\rCompressing: 100.0%\n";
-    cout << "Compression complete!\n";
+    // Solve the reduced problem, recursing only if names are not unique
+    int *s1 = SA + n - n1;
+    int *SA1 = SA;
+    if (name < n1)
+        buildSuffixArray(s1, SA1, n1, name);
+    else
+        for (int i = 0; i < n1; i++)
+            SA1[s1[i]] = i;
+
+    // Induce the full suffix array from the sorted LMS suffixes
+    getBuckets(true);
+    for (int i = 1, j = 0; i < n; i++)
+        if (isLMS(i))
+            s1[j++] = i;
+    for (int i = 0; i < n1; i++)
+        SA1[i] = s1[SA1[i]];
+    fill(SA + n1, SA + n, -1);
+    for (int i = n1 - 1; i >= 0; i--)
+    {
+        int j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[s[j]]] = j;
+    }
+    induce();
 }
 
-// Decode block from file
-vector<unsigned char> decodeBlock(ifstream &in, uint32_t bitLength)
+// Burrows-Wheeler transform of block; primary receives the row of the original string
+vector<unsigned char> bwtForward(const vector<unsigned char> &block, uint32_t &primary)
 {
-    unordered_map<unsigned char, string> codes = loadCanonicalTable(in);
+    int n = static_cast<int>(block.size());
+    vector<int> s(n + 1), SA(n + 1);
+    for (int i = 0; i < n; i++)
+        s[i] = block[i] + 1;
+    s[n] = 0;
+    buildSuffixArray(s.data(), SA.data(), n + 1, 257);
 
-    Node *root = new Node('\0', 0);
-    for (auto &[c, code] : codes)
+    // Row 0 is the sentinel suffix; the sentinel itself is dropped from the output
+    vector<unsigned char> last;
+    last.reserve(n);
+    primary = 0;
+    for (int i = 0; i <= n; i++)
     {
-        Node *node = root;
-        for (char b : code)
+        if (SA[i] == 0)
+            primary = i;
+        else
+            last.push_back(block[SA[i] - 1]);
+    }
+    return last;
+}
+
+// Inverse Burrows-Wheeler transform
+vector<unsigned char> bwtInverse(const vector<unsigned char> &last, uint32_t primary)
+{
+    size_t n = last.size();
+    if (primary > n)
+        return {};
+
+    // Counts include the sentinel, which sorts before every byte
+    vector<uint32_t> start(256, 0);
+    for (unsigned char c : last)
+        start[c]++;
+    uint32_t sum = 1;
+    for (int c = 0; c < 256; c++)
+    {
+        uint32_t cnt = start[c];
+        start[c] = sum;
+        sum += cnt;
+    }
+
+    // LF mapping over the n + 1 rows, with the sentinel at row primary
+    vector<uint32_t> lf(n + 1);
+    for (size_t i = 0; i <= n; i++)
+    {
+        if (i == primary)
+            lf[i] = 0;
+        else
+            lf[i] = start[last[i < primary ? i : i - 1]]++;
+    }
+
+    vector<unsigned char> block(n);
+    size_t row = 0;
+    for (size_t k = n; k-- > 0;)
+    {
+        block[k] = last[row < primary ? row : row - 1];
+        row = lf[row];
+    }
+    return block;
+}
+
+// Move-to-front transform
+vector<unsigned char> mtfEncode(const vector<unsigned char> &data)
+{
+    unsigned char order[256];
+    for (int i = 0; i < 256; i++)
+        order[i] = static_cast<unsigned char>(i);
+
+    vector<unsigned char> out(data.size());
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        unsigned char c = data[i];
+        int j = 0;
+        while (order[j] != c)
+            j++;
+        out[i] = static_cast<unsigned char>(j);
+        memmove(order + 1, order, j);
+        order[0] = c;
+    }
+    return out;
+}
+
+// Inverse move-to-front transform
+vector<unsigned char> mtfDecode(const vector<unsigned char> &data)
+{
+    unsigned char order[256];
+    for (int i = 0; i < 256; i++)
+        order[i] = static_cast<unsigned char>(i);
+
+    vector<unsigned char> out(data.size());
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        int j = data[i];
+        unsigned char c = order[j];
+        out[i] = c;
+        memmove(order + 1, order, j);
+        order[0] = c;
+    }
+    return out;
+}
+
+/*
+ * Zero-run coding of MTF output (bzip2 style)
+ *
+ * Runs of zeros are written in bijective base 2 using RUNA/RUNB symbols.
+ * MTF values 1..253 map to symbols 2..254; the rare values 254 and 255 are
+ * written as ZRL_ESCAPE followed by 0 or 1.
+ */
+const unsigned char ZRL_RUNA = 0;
+const unsigned char ZRL_RUNB = 1;
+const unsigned char ZRL_ESCAPE = 255;
+
+vector<unsigned char> zeroRunEncode(const vector<unsigned char> &mtf)
+{
+    vector<unsigned char> out;
+    out.reserve(mtf.size());
+    size_t i = 0;
+    while (i < mtf.size())
+    {
+        if (mtf[i] == 0)
         {
-            if (b == '1')
+            size_t run = 0;
+            while (i < mtf.size() && mtf[i] == 0)
             {
-                if (!node->left)
-                    node->left = new Node('\0', 0);
-                node = node->left;
+                run++;
+                i++;
             }
-            else
+            while (run > 0)
             {
-                if (!node->right)
-                    node->right = new Node('\0', 0);
-                node = node->right;
+                if (run & 1)
+                {
+                    out.push_back(ZRL_RUNA);
+                    run = (run - 1) / 2;
+                }
+                else
+                {
+                    out.push_back(ZRL_RUNB);
+                    run = (run - 2) / 2;
+                }
             }
+            continue;
         }
-        node->ch = c;
-    }
 
-    vector<unsigned char> decoded;
-    Node *node = root;
-    int bitsRead = 0;
-    while (bitsRead < bitLength)
-    {
-        int val = in.get();
-        if (val == EOF)
-            break;
-        uint8_t byte = static_cast<uint8_t>(val);
-        for (int i = 7; i >= 0 && bitsRead < bitLength; i--)
+        unsigned char v = mtf[i++];
+        if (v >= 254)
         {
-            bool bit = (byte >> i) & 1;
-            node = bit ? node->left : node->right;
-            if (!node->left && !node->right)
-            {
-                decoded.push_back(node->ch);
-                node = root;
-            }
-            bitsRead++;
+            out.push_back(ZRL_ESCAPE);
+            out.push_back(static_cast<unsigned char>(v - 254));
+        }
+        else
+        {
+            out.push_back(static_cast<unsigned char>(v + 1));
         }
     }
-
-    freeTree(root);
-    return decoded;
+    return out;
 }
 
-// Decompress file in chunks
-void decompressFile(const string &inputFile, const string &outputFile)
+// Inverse zero-run coding; returns false on malformed input or output longer
+// than limit, which also stops runs from growing without bound
+bool zeroRunDecode(const vector<unsigned char> &symbols, vector<unsigned char> &mtf, size_t limit)
 {
-    ifstream in(inputFile, ios::binary);
-    ofstream out(outputFile, ios::binary);
-    if (!in || !out)
+    mtf.clear();
+    size_t run = 0, weight = 1;
+    for (size_t i = 0; i < symbols.size(); i++)
     {
-        cerr << "Error opening files!\n";
-        return;
+        unsigned char s = symbols[i];
+        if (s == ZRL_RUNA || s == ZRL_RUNB)
+        {
+            if (weight > limit)
+                return false;
+            run += (s == ZRL_RUNA ? 1 : 2) * weight;
+            if (run > limit - mtf.size())
+                return false;
+            weight <<= 1;
+            continue;
+        }
+        if (run > 0)
+        {
+            mtf.insert(mtf.end(), run, 0);
+            run = 0;
+            weight = 1;
+        }
+        if (mtf.size() >= limit)
+            return false;
+        if (s == ZRL_ESCAPE)
+        {
+            if (++i >= symbols.size() || symbols[i] > 1)
+                return false;
+            mtf.push_back(static_cast<unsigned char>(254 + symbols[i]));
+        }
+        else
+        {
+            mtf.push_back(static_cast<unsigned char>(s - 1));
+        }
     }
+    if (run > 0)
+        mtf.insert(mtf.end(), run, 0);
+    return true;
+}
 
-    uint64_t totalBytes = getFileSize(in);
-    uint64_t processed = 0;
-    in.clear();
-    in.seekg(0, ios::beg);
+/*
+ * Run-length pre-pass (bzip2 RLE1 style)
+ *
+ * After four equal bytes comes a count byte giving how many more copies of
+ * the byte follow (0-255). A long constant stretch then costs five symbols
+ * per 259 bytes instead of one symbol per byte, which gets past the Huffman
+ * floor of one bit per byte and leaves far fewer symbols to code.
+ */
+const size_t RLE_MIN_RUN = 4;
+const size_t RLE_MAX_EXTRA = 255;
 
-    while (!in.eof())
+vector<unsigned char> rleEncode(const vector<unsigned char> &data)
+{
+    vector<unsigned char> out;
+    out.reserve(data.size());
+    size_t i = 0;
+    while (i < data.size())
     {
-        streampos blockStart = in.tellg();
-        uint32_t bitLength;
-        in.read(reinterpret_cast<char *>(&bitLength), sizeof(bitLength));
-        if (in.eof())
-            break;
-        vector<unsigned char> block = decodeBlock(in, bitLength);
-        out.write(reinterpret_cast<char *>(block.data()), block.size());
-
-        streampos afterBlock = in.tellg();
-        if (blockStart != static_cast<streampos>(-1) && afterBlock != static_cast<streampos>(-1))
+        unsigned char c = data[i];
+        size_t run = 1;
+        while (i + run < data.size() && data[i + run] == c && run < RLE_MIN_RUN + RLE_MAX_EXTRA)
+            run++;
+        if (run < RLE_MIN_RUN)
         {
-            processed += static_cast<uint64_t>(afterBlock - blockStart);
-            if (totalBytes > 0)
-            {
-                double pct = (static_cast<double>(processed) * 100.0) / static_cast<double>(totalBytes);
-                if (pct > 100.0)
-                    pct = 100.0;
-                cout << "\rDecompressing: " << fixed << setprecision(1) << pct << "%" << flush;
-            }
+            out.insert(out.end(), run, c);
+        }
+        else
+        {
+            out.insert(out.end(), RLE_MIN_RUN, c);
+            out.push_back(static_cast<unsigned char>(run - RLE_MIN_RUN));
         }
+        i += run;
     }
-
-    in.close();
-    out.close();
-    if (totalBytes > 0)
-        cout << "\rDecompressing: 100.0%\n";
-    cout << "Decompression complete!\n";
+    return out;
 }
 
-int main(int argc, char *argv[])
+// Inverse run-length pre-pass; false if malformed or longer than limit
+bool rleDecode(const vector<unsigned char> &data, vector<unsigned char> &out, size_t limit)
 {
-    if (argc != 4)
+    // limit comes from the block header, so it only stops the output; the
+    // buffer starts at a size the input can plausibly fill and grows from there
+    out.clear();
+    out.reserve(min(limit, 2 * data.size()));
+    size_t same = 0;
+    for (size_t i = 0; i < data.size(); i++)
     {
-        cerr << "Usage: " << argv[0] << " c <input> <compressed>\n"
-             << "   or: " << argv[0] << " d <compressed> <output>\n";
-        return 1;
+        unsigned char c = data[i];
+        same = (same > 0 && c == out.back()) ? same + 1 : 1;
+        out.push_back(c);
+        if (same == RLE_MIN_RUN)
+        {
+            if (++i >= data.size())
+                return false;
+            out.insert(out.end(), static_cast<size_t>(data[i]), c);
+            same = 0;
+        }
+        if (out.size() > limit)
+            return false;
     }
+    return true;
+}
+
+// Get file size without moving the stream on return
+uint64_t getFileSize(ifstream &in)
+{
+    auto current = in.tellg();
+    in.seekg(0, ios::end);
+    auto endPos = in.tellg();
+    in.seekg(current, ios::beg);
+    if (endPos == static_cast<streampos>(-1))
+        return 0;
+    return static_cast<uint64_t>(endPos);
+}
 
-    string mode = argv[1];
-    string first = argv[2];
-    string second = argv[3];
+/*
+ * Compressed file format
+ *
+ * FILE_MAGIC, a version byte and the ID of the dictionary used (0 for none;
+ * absent in version 2), then a sequence of blocks (BLOCK_RLE needs version 4):
+ *   [flags][raw size][primary index, if BLOCK_BWT]
+ *   [table ID, if BLOCK_STATIC_TABLE][Huffman block]
+ * A Huffman block is [bit length][canonical table][packed bits]; the table
+ * is omitted when the block uses a built-in or dictionary one.
+ * Files without the magic are the original headerless run of Huffman blocks.
+ */
+const char FILE_MAGIC[4] = {'H', 'U', 'F', 'Z'};
+const uint8_t FORMAT_VERSION = 4;
+const uint8_t BLOCK_BWT = 0x01;
+const uint8_t BLOCK_STATIC_TABLE = 0x02;
+const uint8_t BLOCK_DICTIONARY = 0x04;
+const uint8_t BLOCK_RLE = 0x08;
 
-    if (mode == "c")
+// Worst-case symbols per input byte: dictionary escapes can double the block,
+// the RLE pass adds a count byte per four bytes and zero-run escapes double it again
+const uint64_t MAX_SYMBOLS_PER_BYTE = 5;
+// Longest code: static and dictionary tables stop at 15 bits, and a per-block
+// Huffman code of length L needs a total weight of at least Fibonacci(L + 2),
+// which for 5 * 2^24 symbols (below Fibonacci(40)) gives at most 37 bits
+const uint64_t MAX_CODE_LENGTH = 37;
+// Largest block whose worst-case bit length still fits the 32-bit header field
+const size_t MAX_BLOCK_SIZE = 1 << 24;
+static_assert(MAX_BLOCK_SIZE * MAX_SYMBOLS_PER_BYTE * MAX_CODE_LENGTH <= UINT32_MAX,
+              "worst-case block bit length must fit the 32-bit header field");
+
+struct Dictionary;
+struct Stats;
+
+// How compressFile and decompressFile report progress (--progress)
+enum ProgressMode
+{
+    PROGRESS_TEXT, // One updating line on cout
+    PROGRESS_JSON, // One JSON object per line on cout
+    PROGRESS_NONE
+};
+
+struct CompressOptions
+{
+    size_t blockSize = 1 << 20;
+    bool bwt = false;
+    bool rle = false;
+    bool staticTables = true;
+    const Dictionary *dict = nullptr;
+    size_t threads = max(1u, thread::hardware_concurrency());
+    Stats *stats = nullptr; // Phase timings are collected here if set
+    Trace *trace = nullptr; // Phases are recorded here as trace spans if set
+    ProgressMode progress = PROGRESS_TEXT;
+};
+
+template <typename T>
+void writeValue(ostream &out, T value)
+{
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+bool readValue(istream &in, T &value)
+{
+    in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return in.gcount() == static_cast<streamsize>(sizeof(value));
+}
+
+/*
+ * Trained dictionaries
+ *
+ * A dictionary is trained on a sample corpus and holds:
+ * - pair merges (byte-pair encoding) that turn common phrases into single
+ *   byte codes, using byte values the corpus never contains
+ * - Huffman code lengths for all 256 byte values of the merged corpus
+ * Small files compressed with it lose their shared phrases and need neither
+ * a stored table nor a tree build.
+ *
+ * Input bytes that collide with a merge code or the escape byte are written
+ * as [escape][byte]; merges never span an escape pair.
+ *
+ * Dictionary file: DICT_MAGIC, version, [u32 id][escape][u8 merge count],
+ * [code][left][right] per merge, then 256 code lengths.
+ */
+const char DICT_MAGIC[4] = {'H', 'U', 'F', 'D'};
+const uint8_t DICT_VERSION = 1;
+const uint8_t DICTIONARY_TABLE_ID = 255;
+const size_t MAX_TRAINING_BYTES = 8 << 20;
+const uint32_t MIN_MERGE_COUNT = 8;
+const size_t MAX_TRAINED_CODE_LENGTH = 15;
+
+struct Merge
+{
+    unsigned char code, left, right;
+};
+
+struct Dictionary
+{
+    uint32_t id = 0;
+    unsigned char escape = 0;
+    vector<Merge> merges;
+    uint8_t lengths[256] = {};
+
+    // Derived by finalizeDictionary
+    bool isCode[256] = {};
+    vector<unsigned char> expansion[256];
+    unordered_map<unsigned char, string> codes;
+    Node *decodeTree = nullptr;
+
+    Dictionary() = default;
+    Dictionary(const Dictionary &) = delete;
+    Dictionary &operator=(const Dictionary &) = delete;
+    ~Dictionary() { freeTree(decodeTree); }
+};
+
+// Replace every occurrence of a merge pair in place, leaving escape pairs alone
+void applyMerge(vector<unsigned char> &data, const Merge &m, int escape)
+{
+    size_t w = 0, r = 0, n = data.size();
+    while (r < n)
     {
-        compressFile(first, second);
+        if (data[r] == escape)
+        {
+            data[w++] = data[r++];
+            if (r < n)
+                data[w++] = data[r++];
+        }
+        else if (r + 1 < n && data[r] == m.left && data[r + 1] == m.right)
+        {
+            data[w++] = m.code;
+            r += 2;
+        }
+        else
+        {
+            data[w++] = data[r++];
+        }
     }
-    else if (mode == "d")
+    data.resize(w);
+}
+
+// Code lengths for all 256 byte values; the histogram is smoothed so every
+// byte stays encodable, then flattened until no code exceeds the limit
+void trainCodeLengths(const uint64_t counts[256], uint8_t lengths[256])
+{
+    uint64_t total = 0;
+    for (int c = 0; c < 256; c++)
+        total += counts[c];
+
+    unordered_map<unsigned char, int> freq;
+    for (int c = 0; c < 256; c++)
+        freq[static_cast<unsigned char>(c)] = static_cast<int>(max<uint64_t>(1, (counts[c] << 18) / max<uint64_t>(total, 1)));
+
+    while (true)
     {
-        decompressFile(first, second);
+        Node *tree = buildHuffmanTree(freq);
+        unordered_map<unsigned char, string> codes;
+        buildCodes(tree, "", codes);
+        freeTree(tree);
+
+        size_t longest = 0;
+        for (auto &[c, code] : codes)
+            longest = max(longest, code.size());
+        if (longest <= MAX_TRAINED_CODE_LENGTH)
+        {
+            for (auto &[c, code] : codes)
+                lengths[c] = static_cast<uint8_t>(code.size());
+            return;
+        }
+        for (auto &[c, f] : freq)
+            f = max(1, f / 2);
     }
-    else
+}
+
+// Validate a loaded dictionary and derive its expansions and codes; false if malformed
+bool finalizeDictionary(Dictionary &dict)
+{
+    // Lengths must form a complete prefix code over all 256 bytes
+    uint32_t kraft = 0;
+    for (int c = 0; c < 256; c++)
     {
-        cerr << "Unknown mode: " << mode << " (use 'c' for compress, 'd' for decompress)\n";
-        return 1;
+        if (dict.lengths[c] < 1 || dict.lengths[c] > MAX_TRAINED_CODE_LENGTH)
+            return false;
+        kraft += 1u << (MAX_TRAINED_CODE_LENGTH - dict.lengths[c]);
     }
+    if (kraft != 1u << MAX_TRAINED_CODE_LENGTH)
+        return false;
 
+    // Each merge may only refer to plain bytes or to codes defined before it
+    bool usedLater[256] = {};
+    for (const Merge &m : dict.merges)
+        usedLater[m.code] = true;
+    for (const Merge &m : dict.merges)
+    {
+        if (m.code == dict.escape || dict.isCode[m.code])
+            return false;
+        for (unsigned char part : {m.left, m.right})
+        {
+            if (part == dict.escape || part == m.code || (usedLater[part] && !dict.isCode[part]))
+                return false;
+        }
+        vector<unsigned char> &out = dict.expansion[m.code];
+        for (unsigned char part : {m.left, m.right})
+        {
+            if (dict.isCode[part])
+                out.insert(out.end(), dict.expansion[part].begin(), dict.expansion[part].end());
+            else
+                out.push_back(part);
+        }
+        dict.isCode[m.code] = true;
+    }
+
+    vector<pair<unsigned char, uint8_t>> table;
+    for (int c = 0; c < 256; c++)
+        table.push_back({static_cast<unsigned char>(c), dict.lengths[c]});
+    dict.codes = canonicalCodesFromLengths(table);
+    freeTree(dict.decodeTree);
+    dict.decodeTree = buildDecodeTree(dict.codes);
+    return true;
+}
+
+// FNV-1a hash of the dictionary contents, stored in compressed files to catch mismatches
+uint32_t dictionaryHash(const Dictionary &dict)
+{
+    uint32_t h = 2166136261u;
+    auto mix = [&](unsigned char b)
+    {
+        h ^= b;
+        h *= 16777619u;
+    };
+    mix(dict.escape);
+    for (const Merge &m : dict.merges)
+    {
+        mix(m.code);
+        mix(m.left);
+        mix(m.right);
+    }
+    for (int c = 0; c < 256; c++)
+        mix(dict.lengths[c]);
+    return h;
+}
+
+bool saveDictionary(const string &file, const Dictionary &dict)
+{
+    ofstream out(file, ios::binary);
+    if (!out)
+        return false;
+    out.write(DICT_MAGIC, sizeof(DICT_MAGIC));
+    out.put(DICT_VERSION);
+    writeValue(out, dict.id);
+    out.put(dict.escape);
+    out.put(static_cast<char>(dict.merges.size()));
+    for (const Merge &m : dict.merges)
+    {
+        out.put(m.code);
+        out.put(m.left);
+        out.put(m.right);
+    }
+    out.write(reinterpret_cast<const char *>(dict.lengths), sizeof(dict.lengths));
+    return out.good();
+}
+
+bool loadDictionary(const string &file, Dictionary &dict)
+{
+    ifstream in(file, ios::binary);
+    char magic[sizeof(DICT_MAGIC)] = {};
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, DICT_MAGIC, sizeof(magic)) != 0 || in.get() != DICT_VERSION)
+        return false;
+
+    int escape, mergeCount;
+    if (!readValue(in, dict.id) || (escape = in.get()) == EOF || (mergeCount = in.get()) == EOF)
+        return false;
+    dict.escape = static_cast<unsigned char>(escape);
+    dict.merges.resize(mergeCount);
+    for (Merge &m : dict.merges)
+    {
+        char triple[3];
+        if (!in.read(triple, sizeof(triple)))
+            return false;
+        m = {static_cast<unsigned char>(triple[0]), static_cast<unsigned char>(triple[1]), static_cast<unsigned char>(triple[2])};
+    }
+    if (!in.read(reinterpret_cast<char *>(dict.lengths), sizeof(dict.lengths)))
+        return false;
+    return finalizeDictionary(dict) && dictionaryHash(dict) == dict.id;
+}
+
+// True if the dictionary table should code the block: within STATIC_TABLE_SLACK
+// of optimal and no worse than the built-in table already chosen
+bool isDictionaryTableBetter(const unordered_map<unsigned char, int> &freq, const Dictionary &dict, int staticId)
+{
+    double bits = tableCost(freq, dict.lengths);
+    if (staticId)
+        return bits <= tableCost(freq, STATIC_TABLES[staticId - 1].lengths);
+    return bits <= estimateOptimalBits(freq) * (1.0 + STATIC_TABLE_SLACK);
+}
+
+// Escape colliding bytes and apply the dictionary merges to a block
+vector<unsigned char> dictionaryEncode(const vector<unsigned char> &block, const Dictionary &dict)
+{
+    if (dict.merges.empty())
+        return block;
+
+    vector<unsigned char> data;
+    data.reserve(block.size() + block.size() / 16);
+    for (unsigned char c : block)
+    {
+        if (c == dict.escape || dict.isCode[c])
+            data.push_back(dict.escape);
+        data.push_back(c);
+    }
+    for (const Merge &m : dict.merges)
+        applyMerge(data, m, dict.escape);
+    return data;
+}
+
+// Expand merge codes and escapes back to the original bytes; false if malformed
+bool dictionaryDecode(const vector<unsigned char> &data, const Dictionary &dict, vector<unsigned char> &block)
+{
+    if (dict.merges.empty())
+    {
+        block = data;
+        return true;
+    }
+
+    block.clear();
+    block.reserve(data.size() * 2);
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        unsigned char c = data[i];
+        if (c == dict.escape)
+        {
+            if (++i >= data.size())
+                return false;
+            block.push_back(data[i]);
+        }
+        else if (dict.isCode[c])
+        {
+            block.insert(block.end(), dict.expansion[c].begin(), dict.expansion[c].end());
+        }
+        else
+        {
+            block.push_back(c);
+        }
+    }
+    return true;
+}
+
+// Train a dictionary from sample files and save it
+bool trainDictionary(const vector<string> &sampleFiles, const string &dictFile)
+{
+    vector<vector<unsigned char>> samples;
+    size_t totalBytes = 0;
+    for (const string &file : sampleFiles)
+    {
+        if (totalBytes >= MAX_TRAINING_BYTES)
+            break;
+        ifstream in(file, ios::binary);
+        if (!in)
+        {
+            cerr << "Error opening sample: " << file << "\n";
+            return false;
+        }
+        vector<unsigned char> data(min<uint64_t>(getFileSize(in), MAX_TRAINING_BYTES - totalBytes));
+        in.read(reinterpret_cast<char *>(data.data()), data.size());
+        data.resize(in.gcount());
+        totalBytes += data.size();
+        samples.push_back(move(data));
+    }
+    if (totalBytes == 0)
+    {
+        cerr << "Error: no sample data to train on!\n";
+        return false;
+    }
+
+    // Byte values absent from the corpus become the escape and merge codes
+    uint64_t counts[256] = {};
+    for (auto &sample : samples)
+        for (unsigned char c : sample)
+            counts[c]++;
+    vector<unsigned char> unused;
+    for (int c = 0; c < 256; c++)
+        if (counts[c] == 0)
+            unused.push_back(static_cast<unsigned char>(c));
+
+    Dictionary dict;
+    if (unused.size() >= 2)
+    {
+        dict.escape = unused[0];
+        vector<uint32_t> pairCounts(1 << 16);
+        for (size_t k = 1; k < unused.size(); k++)
+        {
+            fill(pairCounts.begin(), pairCounts.end(), 0);
+            for (auto &sample : samples)
+                for (size_t i = 0; i + 1 < sample.size(); i++)
+                    pairCounts[(sample[i] << 8) | sample[i + 1]]++;
+
+            size_t best = max_element(pairCounts.begin(), pairCounts.end()) - pairCounts.begin();
+            if (pairCounts[best] < MIN_MERGE_COUNT)
+                break;
+
+            Merge m = {unused[k], static_cast<unsigned char>(best >> 8), static_cast<unsigned char>(best & 0xFF)};
+            dict.merges.push_back(m);
+            for (auto &sample : samples)
+                applyMerge(sample, m, dict.escape);
+        }
+    }
+
+    fill(begin(counts), end(counts), 0);
+    for (auto &sample : samples)
+        for (unsigned char c : sample)
+            counts[c]++;
+    trainCodeLengths(counts, dict.lengths);
+    if (!finalizeDictionary(dict))
+    {
+        cerr << "Error: trained dictionary is inconsistent!\n";
+        return false;
+    }
+    dict.id = dictionaryHash(dict);
+
+    if (!saveDictionary(dictFile, dict))
+    {
+        cerr << "Error writing dictionary: " << dictFile << "\n";
+        return false;
+    }
+    cout << "Trained on " << totalBytes << " bytes from " << samples.size() << " files, "
+         << dict.merges.size() << " merges\n";
+    return true;
+}
+
+/*
+ * Memory budget (--max-memory)
+ *
+ * Coding a block holds it several times over: the raw bytes, the transform
+ * outputs and the encoded buffer, and BWT adds a suffix array and its work
+ * space of 4-byte integers. The pipeline keeps up to two blocks per thread in
+ * flight, so a budget is met by running fewer threads and, when even one
+ * thread does not fit, by using smaller blocks.
+ */
+const uint64_t BLOCK_MEMORY_FACTOR = 6;
+const uint64_t BWT_MEMORY_FACTOR = 16;
+const size_t MIN_BUDGET_BLOCK_SIZE = 4 << 10; // 4 KiB
+
+// Estimated peak bytes to code or decode one block of rawSize bytes
+uint64_t blockMemory(uint64_t rawSize, bool bwt)
+{
+    return rawSize * (BLOCK_MEMORY_FACTOR + (bwt ? BWT_MEMORY_FACTOR : 0));
+}
+
+// Lower the thread count, then the block size, until the blocks in flight fit
+// maxMemory bytes; false if not even the smallest block fits
+bool fitMemoryBudget(CompressOptions &opts, uint64_t maxMemory)
+{
+    uint64_t perBlock = blockMemory(opts.blockSize, opts.bwt);
+    size_t threads = static_cast<size_t>(min<uint64_t>(opts.threads, maxMemory / (2 * perBlock)));
+    if (threads >= 2)
+    {
+        opts.threads = threads;
+        return true;
+    }
+
+    // A single thread codes one block at a time
+    opts.threads = 1;
+    if (perBlock <= maxMemory)
+        return true;
+    size_t blockSize = static_cast<size_t>(maxMemory / blockMemory(1, opts.bwt));
+    if (blockSize < MIN_BUDGET_BLOCK_SIZE)
+        return false;
+    opts.blockSize = blockSize;
+    return true;
+}
+
+/*
+ * Statistics (--stats) and tracing (--trace)
+ *
+ * Time is split into the phases below and summed per block. Blocks are worked
+ * on by several threads at once, so phase times are CPU time across threads
+ * and can add up to more than the wall time. With one thread, compressed
+ * blocks go straight into the file buffer and "pack" includes that copy.
+ * Decompression reads packed bits as it decodes them, so its reads are part
+ * of "decode". A trace records every timed phase as a span on the thread
+ * that ran it, in the Chrome trace-event format that chrome://tracing and
+ * Perfetto open.
+ */
+enum Phase
+{
+    PHASE_READ,
+    PHASE_TRANSFORM,
+    PHASE_HISTOGRAM,
+    PHASE_TREE,
+    PHASE_CANONICAL,
+    PHASE_PACK,
+    PHASE_DECODE_TABLE,
+    PHASE_DECODE,
+    PHASE_WRITE,
+    PHASE_COUNT
+};
+
+const char *const PHASE_NAMES[PHASE_COUNT] = {"read", "transform", "histogram", "tree", "canonical",
+                                              "pack", "decode_table", "decode", "write"};
+
+// Nanoseconds spent in each phase of a block. With trace set, the phases are
+// also recorded there as spans of the block
+struct PhaseTimes
+{
+    uint64_t ns[PHASE_COUNT] = {};
+    Trace *trace = nullptr;
+    size_t block = 0;
+};
+
+// Set up times for a block; nullptr (nothing to time) without stats or a trace
+PhaseTimes *blockTiming(PhaseTimes &times, const Stats *stats, Trace *trace, size_t block)
+{
+    times.trace = trace;
+    times.block = block;
+    return stats || trace ? &times : nullptr;
+}
+
+// Adds the time until it goes out of scope to a phase; does nothing without times
+class PhaseTimer
+{
+public:
+    PhaseTimer(PhaseTimes *times, Phase phase) : times(times), phase(phase)
+    {
+        if (times)
+            start = chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer()
+    {
+        if (!times)
+            return;
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        times->ns[phase] += chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+        if (times->trace)
+            times->trace->span(PHASE_NAMES[phase], times->block, start, end);
+    }
+
+private:
+    PhaseTimes *times;
+    Phase phase;
+    chrono::steady_clock::time_point start;
+};
+
+struct BlockStats
+{
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    PhaseTimes times;
+};
+
+// Totals of a compress or decompress run, and the same per block
+struct Stats
+{
+    bool compress = true;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    BlockStats total;
+    vector<BlockStats> blocks;
+    mutex m;
+
+    // Add to the counts of a block; safe to call from any thread
+    void record(size_t index, const PhaseTimes &times, uint64_t bytesIn, uint64_t bytesOut)
+    {
+        lock_guard<mutex> lock(m);
+        if (blocks.size() <= index)
+            blocks.resize(index + 1);
+        for (BlockStats *b : {&blocks[index], &total})
+        {
+            b->bytesIn += bytesIn;
+            b->bytesOut += bytesOut;
+            for (int p = 0; p < PHASE_COUNT; p++)
+                b->times.ns[p] += times.ns[p];
+        }
+    }
+};
+
+// Uncompressed bytes of a block or run: the input when compressing, the output when decompressing
+uint64_t rawBytes(const Stats &stats, const BlockStats &b)
+{
+    return stats.compress ? b.bytesIn : b.bytesOut;
+}
+
+// Megabytes (10^6 bytes) per second, 0 for no time
+double megabytesPerSecond(uint64_t bytes, double seconds)
+{
+    return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+
+void printPhasesJson(ostream &out, const Stats &stats, const BlockStats &b)
+{
+    out << "{\"bytes_in\": " << b.bytesIn << ", \"bytes_out\": " << b.bytesOut << ", \"phases\": {";
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        double seconds = b.times.ns[p] / 1e9;
+        out << (p ? ", " : "") << "\"" << PHASE_NAMES[p] << "\": {\"seconds\": " << seconds
+            << ", \"mb_per_s\": " << megabytesPerSecond(rawBytes(stats, b), seconds) << "}";
+    }
+    out << "}}";
+}
+
+// Print the statistics of a run as text or JSON, optionally with one entry per block
+void printStats(ostream &out, const Stats &stats, bool json, bool perBlock)
+{
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - stats.start).count();
+    double throughput = megabytesPerSecond(rawBytes(stats, stats.total), wall);
+    if (json)
+    {
+        out << "{\"mode\": \"" << (stats.compress ? "compress" : "decompress") << "\", \"wall_seconds\": " << wall
+            << ", \"mb_per_s\": " << throughput << ", \"blocks\": " << stats.blocks.size()
+            << ", \"peak_rss_bytes\": " << peakMemory() << ", \"total\": ";
+        printPhasesJson(out, stats, stats.total);
+        if (perBlock)
+        {
+            out << ", \"per_block\": [";
+            for (size_t i = 0; i < stats.blocks.size(); i++)
+            {
+                out << (i ? ", " : "");
+                printPhasesJson(out, stats, stats.blocks[i]);
+            }
+            out << "]";
+        }
+        out << "}\n";
+        return;
+    }
+
+    out << fixed << setprecision(3);
+    out << "=== Statistics (" << (stats.compress ? "compress" : "decompress") << ") ===\n"
+        << "Bytes in:   " << stats.total.bytesIn << "\n"
+        << "Bytes out:  " << stats.total.bytesOut << "\n"
+        << "Blocks:     " << stats.blocks.size() << "\n"
+        << "Wall time:  " << wall << " s (" << setprecision(1) << throughput << " MB/s)\n"
+        << "Peak RSS:   " << peakMemory() << " bytes\n"
+        << setprecision(3) << left << setw(14) << "Phase" << right << setw(12) << "seconds" << setw(12) << "MB/s"
+        << "\n";
+    for (int p = 0; p < PHASE_COUNT; p++)
+    {
+        double seconds = stats.total.times.ns[p] / 1e9;
+        if (stats.total.times.ns[p] == 0)
+            continue;
+        out << left << setw(14) << PHASE_NAMES[p] << right << setw(12) << seconds << setw(12) << setprecision(1)
+            << megabytesPerSecond(rawBytes(stats, stats.total), seconds) << setprecision(3) << "\n";
+    }
+    if (perBlock)
+    {
+        out << "Per block (seconds):\n" << setw(8) << "block" << setw(12) << "in" << setw(12) << "out";
+        for (int p = 0; p < PHASE_COUNT; p++)
+        {
+            if (stats.total.times.ns[p])
+                out << setw(14) << PHASE_NAMES[p];
+        }
+        out << "\n";
+        for (size_t i = 0; i < stats.blocks.size(); i++)
+        {
+            const BlockStats &b = stats.blocks[i];
+            out << setw(8) << i << setw(12) << b.bytesIn << setw(12) << b.bytesOut << setprecision(6);
+            for (int p = 0; p < PHASE_COUNT; p++)
+            {
+                if (stats.total.times.ns[p])
+                    out << setw(14) << b.times.ns[p] / 1e9;
+            }
+            out << setprecision(3) << "\n";
+        }
+    }
+    out << defaultfloat;
+}
+
+// Build canonical codes for a block from its histogram
+unordered_map<unsigned char, string> buildBlockCodes(const unordered_map<unsigned char, int> &freq,
+                                                     PhaseTimes *times = nullptr)
+{
+    unordered_map<unsigned char, string> codes;
+    {
+        PhaseTimer timer(times, PHASE_TREE);
+        Node *tree = buildHuffmanTree(freq);
+        buildCodes(tree, "", codes);
+        freeTree(tree);
+    }
+    PhaseTimer timer(times, PHASE_CANONICAL);
+    return makeCanonicalCodes(codes);
+}
+
+// Huffman-code data as bit length, optional canonical table and packed bits
+void writeHuffmanBlock(ostream &out, const vector<unsigned char> &data,
+                       const unordered_map<unsigned char, string> &codes, bool withTable)
+{
+    const string *codeOf[256] = {};
+    for (auto &[c, code] : codes)
+        codeOf[c] = &code;
+
+    uint8_t buffer = 0;
+    int count = 0;
+    // At most UINT32_MAX for blocks up to MAX_BLOCK_SIZE (see the static_assert there)
+    uint64_t bitLength = 0;
+    for (unsigned char c : data)
+        bitLength += codeOf[c]->size();
+    writeValue(out, static_cast<uint32_t>(bitLength));
+
+    if (withTable)
+        saveCanonicalTable(out, codes);
+
+    for (unsigned char c : data)
+        writeBits(out, *codeOf[c], buffer, count);
+    flushBits(out, buffer, count);
+}
+
+// Apply the selected transforms to a block and write it out
+void compressBlock(ostream &out, const vector<unsigned char> &block, const CompressOptions &opts,
+                   PhaseTimes *times = nullptr)
+{
+    uint8_t flags = 0;
+    uint32_t primary = 0;
+    vector<unsigned char> transformed;
+    const vector<unsigned char> *symbols = &block;
+    {
+        PhaseTimer timer(times, PHASE_TRANSFORM);
+        if (opts.dict)
+        {
+            flags |= BLOCK_DICTIONARY;
+            transformed = dictionaryEncode(block, *opts.dict);
+            symbols = &transformed;
+        }
+        if (opts.rle)
+        {
+            // Keep the run-length pass only where it lowers the entropy estimate
+            vector<unsigned char> runs = rleEncode(*symbols);
+            if (runs.size() < symbols->size() &&
+                estimateOptimalBits(buildHistogram(runs)) < estimateOptimalBits(buildHistogram(*symbols)))
+            {
+                flags |= BLOCK_RLE;
+                transformed = move(runs);
+                symbols = &transformed;
+            }
+        }
+        if (opts.bwt)
+        {
+            flags |= BLOCK_BWT;
+            transformed = zeroRunEncode(mtfEncode(bwtForward(*symbols, primary)));
+            symbols = &transformed;
+        }
+    }
+
+    unordered_map<unsigned char, int> freq;
+    {
+        PhaseTimer timer(times, PHASE_HISTOGRAM);
+        freq = buildHistogram(*symbols);
+    }
+    int tableId = 0;
+    {
+        PhaseTimer timer(times, PHASE_TREE);
+        tableId = opts.staticTables ? chooseStaticTable(freq) : 0;
+        if (opts.dict && isDictionaryTableBetter(freq, *opts.dict, tableId))
+            tableId = DICTIONARY_TABLE_ID;
+    }
+    if (tableId)
+        flags |= BLOCK_STATIC_TABLE;
+
+    const unordered_map<unsigned char, string> *codes;
+    unordered_map<unsigned char, string> blockCodes;
+    if (tableId)
+    {
+        codes = tableId == DICTIONARY_TABLE_ID ? &opts.dict->codes : &staticTableCodes(tableId);
+    }
+    else
+    {
+        blockCodes = buildBlockCodes(freq, times);
+        codes = &blockCodes;
+    }
+
+    PhaseTimer timer(times, PHASE_PACK);
+    out.put(flags);
+    writeValue(out, static_cast<uint32_t>(block.size()));
+    if (flags & BLOCK_BWT)
+        writeValue(out, primary);
+    if (tableId)
+        out.put(static_cast<char>(tableId));
+    writeHuffmanBlock(out, *symbols, *codes, !tableId);
+}
+
+/*
+ * Progress reporting (--progress)
+ *
+ * The block loops only add to an atomic byte count. A reporter thread samples
+ * it every PROGRESS_INTERVAL and prints the percentage, throughput and time
+ * left, so the cost of reporting does not grow with the number of blocks. In
+ * JSON mode each report is one line for scripts to parse:
+ *
+ *   {"event": "progress", "mode": "compress", "bytes": 1048576, "total": 8388608,
+ *    "percent": 12.5, "mb_per_s": 210.3, "eta_seconds": 0.035}
+ *
+ * The last line has "event" "done", or "failed" if the run stopped early, and
+ * stands in for the "complete" message, so stdout holds nothing but JSON.
+ */
+const chrono::milliseconds PROGRESS_INTERVAL(500);
+
+class ProgressReporter
+{
+public:
+    // Report on total input bytes; nothing is printed for PROGRESS_NONE or an empty input
+    ProgressReporter(bool compress, uint64_t total, ProgressMode mode) : compress(compress), total(total), mode(mode)
+    {
+        if (mode != PROGRESS_NONE && total > 0)
+            reporter = thread([this] { run(); });
+    }
+
+    // A run that did not call finish() is reported as failed
+    ~ProgressReporter() { finish(false); }
+
+    // Count bytes as done; safe to call from any thread
+    void add(uint64_t bytes) { done.fetch_add(bytes, memory_order_relaxed); }
+
+    // Stop the reporter and print the last report
+    void finish(bool ok = true)
+    {
+        if (!reporter.joinable())
+            return;
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_one();
+        reporter.join();
+        print(ok ? "done" : "failed", ok ? total : done.load(memory_order_relaxed));
+    }
+
+private:
+    void run()
+    {
+        unique_lock<mutex> lock(m);
+        while (!cv.wait_for(lock, PROGRESS_INTERVAL, [this] { return stopping; }))
+            print("progress", done.load(memory_order_relaxed));
+    }
+
+    void print(const char *event, uint64_t bytes)
+    {
+        bytes = min(bytes, total);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double rate = megabytesPerSecond(bytes, seconds);
+        double percent = 100.0 * bytes / total;
+        double eta = rate > 0 ? (total - bytes) / rate / 1e6 : 0;
+        bool last = strcmp(event, "progress") != 0;
+        ostringstream line;
+        if (mode == PROGRESS_JSON)
+        {
+            line << "{\"event\": \"" << event << "\", \"mode\": \"" << (compress ? "compress" : "decompress")
+                 << "\", \"bytes\": " << bytes << ", \"total\": " << total << ", \"percent\": " << percent
+                 << ", \"mb_per_s\": " << rate << ", \"eta_seconds\": " << eta << "}\n";
+        }
+        else
+        {
+            // Trailing spaces clear what is left of a longer previous line
+            line << "\r" << (compress ? "Compressing: " : "Decompressing: ") << fixed << setprecision(1) << percent
+                 << "%  " << rate << " MB/s";
+            if (!last)
+                line << "  ETA " << setprecision(0) << eta << " s";
+            line << "      " << (last ? "\n" : "");
+        }
+        cout << line.str() << flush;
+    }
+
+    bool compress;
+    uint64_t total;
+    ProgressMode mode;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    atomic<uint64_t> done{0};
+    thread reporter;
+    mutex m;
+    condition_variable cv;
+    bool stopping = false;
+};
+
+// Compresses blocks on a thread pool and writes them in submission order,
+// holding at most two blocks per thread in memory; single-threaded without a pool.
+// Blocks are counted as done on progress once written
+class BlockPipeline
+{
+public:
+    BlockPipeline(ostream &out, const CompressOptions &opts, ProgressReporter *progress = nullptr)
+        : out(out), opts(opts), progress(progress), maxInFlight(2 * opts.threads)
+    {
+        if (opts.threads > 1)
+            pool = make_unique<ThreadPool>(opts.threads);
+    }
+
+    void submit(vector<unsigned char> block)
+    {
+        size_t index = submitted++;
+        if (!pool)
+        {
+            uint64_t start = out.tellp();
+            offsets.push_back(start);
+            PhaseTimes times;
+            compressBlock(out, block, opts, blockTiming(times, opts.stats, opts.trace, index));
+            if (opts.stats)
+                opts.stats->record(index, times, 0, static_cast<uint64_t>(out.tellp()) - start);
+            if (progress)
+                progress->add(block.size());
+            return;
+        }
+        if (pending.size() >= maxInFlight)
+            writeOldest();
+        rawSizes.push_back(block.size());
+        auto data = make_shared<vector<unsigned char>>(move(block));
+        const CompressOptions &o = opts;
+        pending.push_back(pool->submit([data, index, &o]
+                                       {
+            ostringstream buf;
+            PhaseTimes times;
+            compressBlock(buf, *data, o, blockTiming(times, o.stats, o.trace, index));
+            string encoded = buf.str();
+            if (o.stats)
+                o.stats->record(index, times, 0, encoded.size());
+            return encoded; }));
+    }
+
+    void finish()
+    {
+        while (!pending.empty())
+            writeOldest();
+    }
+
+    // Output offset of every block written so far
+    vector<uint64_t> offsets;
+
+private:
+    void writeOldest()
+    {
+        string encoded = pending.front().get();
+        pending.pop_front();
+        PhaseTimes times;
+        {
+            PhaseTimer timer(blockTiming(times, opts.stats, opts.trace, offsets.size()), PHASE_WRITE);
+            offsets.push_back(out.tellp());
+            out.write(encoded.data(), encoded.size());
+        }
+        if (opts.stats)
+            opts.stats->record(offsets.size() - 1, times, 0, 0);
+        if (progress)
+            progress->add(rawSizes.front());
+        rawSizes.pop_front();
+    }
+
+    ostream &out;
+    const CompressOptions &opts;
+    ProgressReporter *progress;
+    size_t maxInFlight;
+    unique_ptr<ThreadPool> pool;
+    deque<future<string>> pending;
+    deque<size_t> rawSizes; // Input bytes of each pending block
+    size_t submitted = 0;
+};
+
+// Compress file in chunks; false (with the output removed) on failure
+bool compressFile(const string &inputFile, const string &outputFile, const CompressOptions &opts = {})
+{
+    ifstream in(inputFile, ios::binary);
+    if (!in)
+    {
+        cerr << "Error opening files!\n";
+        return false;
+    }
+    ofstream out(outputFile, ios::binary);
+    if (!out)
+    {
+        cerr << "Error opening files!\n";
+        return false;
+    }
+
+    ProgressReporter progress(true, getFileSize(in), opts.progress);
+
+    out.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+    out.put(FORMAT_VERSION);
+    writeValue(out, opts.dict ? opts.dict->id : 0u);
+
+    BlockPipeline pipeline(out, opts, &progress);
+    for (size_t index = 0; !in.eof(); index++)
+    {
+        PhaseTimes times;
+        vector<unsigned char> block;
+        {
+            PhaseTimer timer(blockTiming(times, opts.stats, opts.trace, index), PHASE_READ);
+            block.resize(opts.blockSize);
+            in.read(reinterpret_cast<char *>(block.data()), opts.blockSize);
+            block.resize(in.gcount());
+        }
+        size_t readBytes = block.size();
+        if (readBytes == 0)
+            break;
+        if (opts.stats)
+            opts.stats->record(index, times, readBytes, 0);
+
+        pipeline.submit(move(block));
+    }
+    pipeline.finish();
+
+    in.close();
+    out.close();
+    if (in.bad() || !out)
+    {
+        cerr << "Error: failed to read input or write output!\n";
+        return discardOutput(out, outputFile);
+    }
+    progress.finish();
+    if (opts.progress != PROGRESS_JSON)
+        cout << "Compression complete!\n";
+    return true;
+}
+
+// Decode bitLength bits from file by walking the tree; expected is the output
+// size when known, so the buffer is allocated once
+vector<unsigned char> decodeBits(istream &in, uint32_t bitLength, Node *root, size_t expected = 0)
+{
+    vector<unsigned char> decoded;
+    decoded.reserve(min<size_t>(expected, bitLength));
+    Node *node = root;
+    uint32_t bitsRead = 0;
+    while (bitsRead < bitLength)
+    {
+        int val = in.get();
+        if (val == EOF)
+            break;
+        uint8_t byte = static_cast<uint8_t>(val);
+        for (int i = 7; i >= 0 && bitsRead < bitLength; i--)
+        {
+            bool bit = (byte >> i) & 1;
+            node = bit ? node->left : node->right;
+            if (!node)
+                return decoded; // No code starts with these bits
+            if (!node->left && !node->right)
+            {
+                decoded.push_back(node->ch);
+                node = root;
+            }
+            bitsRead++;
+        }
+    }
+    return decoded;
+}
+
+// Decode block from file
+vector<unsigned char> decodeBlock(istream &in, uint32_t bitLength, PhaseTimes *times = nullptr, size_t expected = 0)
+{
+    Node *root;
+    {
+        PhaseTimer timer(times, PHASE_DECODE_TABLE);
+        unordered_map<unsigned char, string> codes = loadCanonicalTable(in);
+        root = buildDecodeTree(codes);
+    }
+    vector<unsigned char> decoded;
+    {
+        PhaseTimer timer(times, PHASE_DECODE);
+        decoded = decodeBits(in, bitLength, root, expected);
+    }
+    freeTree(root);
+    return decoded;
+}
+
+// Decoding trees of the built-in tables, freed at exit
+struct StaticDecodeTrees
+{
+    vector<Node *> trees;
+
+    StaticDecodeTrees()
+    {
+        for (int i = 1; i <= STATIC_TABLE_COUNT; i++)
+            trees.push_back(buildDecodeTree(staticTableCodes(i)));
+    }
+    StaticDecodeTrees(const StaticDecodeTrees &) = delete;
+    StaticDecodeTrees &operator=(const StaticDecodeTrees &) = delete;
+    ~StaticDecodeTrees()
+    {
+        for (Node *tree : trees)
+            freeTree(tree);
+    }
+};
+
+// Decoding tree of a built-in table, built once on first use
+Node *staticDecodeTree(int id)
+{
+    static const StaticDecodeTrees cache;
+    return cache.trees[id - 1];
+}
+
+// Read one block and undo its transforms; false on truncated or corrupt input
+bool decompressBlock(istream &in, vector<unsigned char> &block, const Dictionary *dict = nullptr,
+                     PhaseTimes *times = nullptr)
+{
+    int flags = in.get();
+    uint32_t rawSize, bitLength;
+    uint32_t primary = 0;
+    int tableId = 0;
+    if (flags == EOF || !readValue(in, rawSize))
+        return false;
+    if ((flags & BLOCK_BWT) && !readValue(in, primary))
+        return false;
+    if (flags & BLOCK_STATIC_TABLE)
+    {
+        tableId = in.get();
+        bool known = (tableId >= 1 && tableId <= STATIC_TABLE_COUNT) || (tableId == DICTIONARY_TABLE_ID && dict);
+        if (!known)
+            return false;
+    }
+    if ((flags & BLOCK_DICTIONARY) && !dict)
+        return false;
+    if (!readValue(in, bitLength))
+        return false;
+
+    // Without transforms the Huffman output is the block itself
+    size_t expected = (flags & (BLOCK_BWT | BLOCK_RLE | BLOCK_DICTIONARY)) ? 0 : min<size_t>(rawSize, MAX_BLOCK_SIZE);
+    vector<unsigned char> symbols;
+    if (tableId)
+    {
+        PhaseTimer timer(times, PHASE_DECODE);
+        Node *root = tableId == DICTIONARY_TABLE_ID ? dict->decodeTree : staticDecodeTree(tableId);
+        symbols = decodeBits(in, bitLength, root, expected);
+    }
+    else
+    {
+        symbols = decodeBlock(in, bitLength, times, expected);
+    }
+
+    // Longest the block can be between transforms: dictionary escapes can at
+    // most double it, and the RLE pass is only kept where it shrinks the block
+    size_t limit = min<size_t>(rawSize, MAX_BLOCK_SIZE) * ((flags & BLOCK_DICTIONARY) ? 2 : 1);
+
+    PhaseTimer timer(times, PHASE_TRANSFORM);
+    if (flags & BLOCK_BWT)
+    {
+        vector<unsigned char> mtf;
+        if (!zeroRunDecode(symbols, mtf, limit))
+            return false;
+        symbols = bwtInverse(mtfDecode(mtf), primary);
+    }
+    if (flags & BLOCK_RLE)
+    {
+        vector<unsigned char> runs;
+        if (!rleDecode(symbols, runs, limit))
+            return false;
+        symbols = move(runs);
+    }
+    if (flags & BLOCK_DICTIONARY)
+    {
+        if (!dictionaryDecode(symbols, *dict, block))
+            return false;
+    }
+    else
+    {
+        block = move(symbols);
+    }
+    return block.size() == rawSize;
+}
+
+// Decompress file in chunks; false (with the output removed) on failure.
+// Blocks are decoded one at a time, so a memory budget of maxMemory bytes (0 for
+// none) cannot lower anything and only warns about blocks that exceed it
+bool decompressFile(const string &inputFile, const string &outputFile, const Dictionary *dict = nullptr,
+                    Stats *stats = nullptr, Trace *trace = nullptr, ProgressMode progressMode = PROGRESS_TEXT,
+                    uint64_t maxMemory = 0)
+{
+    ifstream in(inputFile, ios::binary);
+    if (!in)
+    {
+        cerr << "Error opening files!\n";
+        return false;
+    }
+    ofstream out(outputFile, ios::binary);
+    if (!out)
+    {
+        cerr << "Error opening files!\n";
+        return false;
+    }
+
+    ProgressReporter progress(false, getFileSize(in), progressMode);
+    in.clear();
+    in.seekg(0, ios::beg);
+
+    char magic[sizeof(FILE_MAGIC)] = {};
+    in.read(magic, sizeof(magic));
+    bool legacy = in.gcount() != sizeof(magic) || memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0;
+    if (legacy)
+    {
+        in.clear();
+        in.seekg(0, ios::beg);
+    }
+    else
+    {
+        int version = in.get();
+        uint32_t dictId = 0;
+        if (version < 2 || version > FORMAT_VERSION)
+        {
+            cerr << "Unsupported compressed file version!\n";
+            return discardOutput(out, outputFile);
+        }
+        if (version >= 3 && !readValue(in, dictId))
+        {
+            cerr << "Error: truncated file header!\n";
+            return discardOutput(out, outputFile);
+        }
+        if (dictId != 0 && (!dict || dict->id != dictId))
+        {
+            cerr << "Error: file was compressed with a different dictionary (use --dict)!\n";
+            return discardOutput(out, outputFile);
+        }
+    }
+
+    bool overBudget = false;
+    for (size_t index = 0; !in.eof(); index++)
+    {
+        streampos blockStart = in.tellg();
+        vector<unsigned char> block;
+        PhaseTimes times;
+        PhaseTimes *blockTimes = blockTiming(times, stats, trace, index);
+        if (maxMemory > 0 && !legacy && !overBudget && in.peek() != EOF)
+        {
+            // Peek at the flags and raw size that start the block header
+            int flags = in.get();
+            uint32_t rawSize = 0;
+            uint64_t needed = readValue(in, rawSize) ? blockMemory(rawSize, (flags & BLOCK_BWT) != 0) : 0;
+            if (needed > maxMemory)
+            {
+                cerr << "Warning: blocks of this file need about " << (needed >> 20)
+                     << " MiB each to decode, more than the memory budget\n";
+                overBudget = true;
+            }
+            in.clear();
+            in.seekg(blockStart);
+        }
+        if (legacy)
+        {
+            uint32_t bitLength;
+            in.read(reinterpret_cast<char *>(&bitLength), sizeof(bitLength));
+            if (in.eof())
+                break;
+            block = decodeBlock(in, bitLength, blockTimes);
+            if (in.fail())
+            {
+                cerr << "\nError: corrupt or truncated block!\n";
+                return discardOutput(out, outputFile);
+            }
+        }
+        else
+        {
+            if (in.peek() == EOF)
+                break;
+            if (!decompressBlock(in, block, dict, blockTimes))
+            {
+                cerr << "\nError: corrupt or truncated block!\n";
+                return discardOutput(out, outputFile);
+            }
+        }
+        {
+            PhaseTimer timer(blockTimes, PHASE_WRITE);
+            out.write(reinterpret_cast<char *>(block.data()), block.size());
+        }
+
+        streampos afterBlock = in.tellg();
+        if (blockStart != static_cast<streampos>(-1) && afterBlock != static_cast<streampos>(-1))
+        {
+            if (stats)
+                stats->record(index, times, static_cast<uint64_t>(afterBlock - blockStart), block.size());
+            progress.add(static_cast<uint64_t>(afterBlock - blockStart));
+        }
+    }
+
+    in.close();
+    out.close();
+    if (!out)
+    {
+        cerr << "Error: failed to write output!\n";
+        return discardOutput(out, outputFile);
+    }
+    progress.finish();
+    if (progressMode != PROGRESS_JSON)
+        cout << "Decompression complete!\n";
+    return true;
+}
+
+/*
+ * Archives
+ *
+ * An archive stores many files as compressed blocks followed by a central
+ * directory. In a solid archive the files are concatenated into one stream
+ * and cut into blocks of the configured size, so small files share blocks
+ * and tables. Otherwise every file starts a new block, so entries can be
+ * extracted independently. Blocks are compressed and extracted in parallel.
+ *
+ * Layout: ARCHIVE_MAGIC, version, flags (version 2+), dictionary ID, the
+ * compressed blocks, then the central directory:
+ *   [block count] [offset][raw size] per block
+ *   [file count]  [name length][name][size][stream offset] per file, followed
+ *                 in version 2+ by [mode][first block][block count]
+ * and a trailer [directory offset][ARCHIVE_MAGIC]. A file's stream offset
+ * locates it in the concatenated data of all blocks.
+ */
+const char ARCHIVE_MAGIC[4] = {'H', 'U', 'F', 'A'};
+const uint8_t ARCHIVE_VERSION = 2;
+const uint8_t ARCHIVE_SOLID = 0x01;
+
+struct ArchiveBlock
+{
+    uint64_t offset;
+    uint32_t rawSize;
+    uint64_t streamOffset;
+};
+
+struct ArchiveEntry
+{
+    string name;
+    uint64_t size;
+    uint64_t streamOffset;
+    uint32_t mode;
+    uint32_t firstBlock;
+    uint32_t blockCount;
+};
+
+// Mode value meaning "no permissions recorded" (version 1 archives)
+const uint32_t NO_MODE = 0xFFFFFFFF;
+
+// Name stored for a file: relative, with forward slashes
+string archiveName(const string &file)
+{
+    return filesystem::path(file).relative_path().lexically_normal().generic_string();
+}
+
+// Reject names that would escape the extraction directory
+bool isSafeArchiveName(const string &name)
+{
+    filesystem::path p(name);
+    if (name.empty() || p.is_absolute() || p.has_root_name())
+        return false;
+    for (const auto &part : p)
+        if (part == "..")
+            return false;
+    return true;
+}
+
+// Expand directories on the command line into the regular files below them
+vector<string> collectFiles(const vector<string> &inputs)
+{
+    vector<string> files;
+    for (const string &input : inputs)
+    {
+        error_code ec;
+        if (filesystem::is_directory(input, ec))
+        {
+            vector<string> found;
+            for (const auto &entry : filesystem::recursive_directory_iterator(input, ec))
+                if (entry.is_regular_file())
+                    found.push_back(entry.path().string());
+            sort(found.begin(), found.end());
+            files.insert(files.end(), found.begin(), found.end());
+        }
+        else
+        {
+            files.push_back(input);
+        }
+    }
+    return files;
+}
+
+// Pack files into an archive, solid or one block range per file; false (with
+// the archive removed) on failure
+bool createArchive(const string &archiveFile, const vector<string> &inputs, const CompressOptions &opts, bool solid)
+{
+    ofstream out(archiveFile, ios::binary);
+    if (!out)
+    {
+        cerr << "Error opening archive: " << archiveFile << "\n";
+        return false;
+    }
+    out.write(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    out.put(ARCHIVE_VERSION);
+    out.put(solid ? ARCHIVE_SOLID : 0);
+    writeValue(out, opts.dict ? opts.dict->id : 0u);
+
+    BlockPipeline pipeline(out, opts);
+    vector<uint32_t> blockSizes;
+    vector<ArchiveEntry> entries;
+    vector<unsigned char> block;
+    block.reserve(opts.blockSize);
+    uint64_t streamOffset = 0;
+
+    auto flushBlock = [&]()
+    {
+        if (block.empty())
+            return;
+        blockSizes.push_back(static_cast<uint32_t>(block.size()));
+        pipeline.submit(move(block));
+        block = vector<unsigned char>();
+        block.reserve(opts.blockSize);
+    };
+
+    for (const string &file : collectFiles(inputs))
+    {
+        ifstream in(file, ios::binary);
+        if (!in)
+        {
+            cerr << "Error opening file: " << file << "\n";
+            return discardOutput(out, archiveFile);
+        }
+
+        error_code ec;
+        auto perms = filesystem::status(file, ec).permissions();
+        ArchiveEntry entry = {archiveName(file), 0, streamOffset, ec ? NO_MODE : static_cast<uint32_t>(perms),
+                              static_cast<uint32_t>(blockSizes.size()), 0};
+        while (in)
+        {
+            size_t oldSize = block.size();
+            block.resize(opts.blockSize);
+            in.read(reinterpret_cast<char *>(block.data() + oldSize), opts.blockSize - oldSize);
+            size_t readBytes = in.gcount();
+            block.resize(oldSize + readBytes);
+            entry.size += readBytes;
+            if (block.size() == opts.blockSize)
+                flushBlock();
+        }
+        if (in.bad())
+        {
+            cerr << "Error reading file: " << file << "\n";
+            return discardOutput(out, archiveFile);
+        }
+        if (!solid)
+            flushBlock();
+
+        // The block still being filled gets the next index once flushed
+        size_t endBlock = blockSizes.size() + (block.empty() ? 0 : 1);
+        if (entry.size > 0)
+            entry.blockCount = static_cast<uint32_t>(endBlock - entry.firstBlock);
+        streamOffset += entry.size;
+        entries.push_back(entry);
+    }
+    flushBlock();
+    pipeline.finish();
+
+    uint64_t directoryOffset = out.tellp();
+    writeValue(out, static_cast<uint32_t>(blockSizes.size()));
+    for (size_t i = 0; i < blockSizes.size(); i++)
+    {
+        writeValue(out, pipeline.offsets[i]);
+        writeValue(out, blockSizes[i]);
+    }
+    writeValue(out, static_cast<uint32_t>(entries.size()));
+    for (const ArchiveEntry &e : entries)
+    {
+        writeValue(out, static_cast<uint16_t>(e.name.size()));
+        out.write(e.name.data(), e.name.size());
+        writeValue(out, e.size);
+        writeValue(out, e.streamOffset);
+        writeValue(out, e.mode);
+        writeValue(out, e.firstBlock);
+        writeValue(out, e.blockCount);
+    }
+    writeValue(out, directoryOffset);
+    out.write(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+
+    if (!out.good())
+    {
+        cerr << "Error writing archive: " << archiveFile << "\n";
+        return discardOutput(out, archiveFile);
+    }
+    cout << "Archived " << entries.size() << " files (" << streamOffset << " bytes) in "
+         << blockSizes.size() << " blocks\n";
+    return true;
+}
+
+// Read the archive header and central directory; false if the archive is malformed
+bool readArchiveDirectory(ifstream &in, uint32_t &dictId, vector<ArchiveBlock> &blocks, vector<ArchiveEntry> &entries)
+{
+    char magic[sizeof(ARCHIVE_MAGIC)] = {};
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0)
+        return false;
+    int version = in.get();
+    if (version != 1 && version != ARCHIVE_VERSION)
+        return false;
+    if (version >= 2 && in.get() == EOF)
+        return false;
+    if (!readValue(in, dictId))
+        return false;
+
+    uint64_t directoryOffset;
+    in.seekg(-static_cast<streamoff>(sizeof(directoryOffset) + sizeof(ARCHIVE_MAGIC)), ios::end);
+    if (!readValue(in, directoryOffset) || !in.read(magic, sizeof(magic)) || memcmp(magic, ARCHIVE_MAGIC, sizeof(magic)) != 0)
+        return false;
+
+    // Counts are checked against the bytes left before anything is allocated:
+    // a block record is 12 bytes and an entry record at least 18
+    in.seekg(0, ios::end);
+    uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+    in.seekg(directoryOffset, ios::beg);
+    if (!in || directoryOffset > fileSize)
+        return false;
+    uint64_t directorySize = fileSize - directoryOffset;
+
+    uint32_t blockCount, entryCount;
+    if (!readValue(in, blockCount) || static_cast<uint64_t>(blockCount) * 12 > directorySize)
+        return false;
+    blocks.resize(blockCount);
+    uint64_t streamOffset = 0;
+    for (ArchiveBlock &b : blocks)
+    {
+        if (!readValue(in, b.offset) || !readValue(in, b.rawSize))
+            return false;
+        b.streamOffset = streamOffset;
+        streamOffset += b.rawSize;
+    }
+
+    if (!readValue(in, entryCount) || static_cast<uint64_t>(entryCount) * 18 > directorySize)
+        return false;
+    entries.resize(entryCount);
+    for (ArchiveEntry &e : entries)
+    {
+        uint16_t nameLength;
+        if (!readValue(in, nameLength))
+            return false;
+        e.name.resize(nameLength);
+        if (!in.read(&e.name[0], nameLength) || !readValue(in, e.size) || !readValue(in, e.streamOffset))
+            return false;
+        if (e.size > streamOffset || e.streamOffset > streamOffset - e.size)
+            return false;
+
+        if (version >= 2)
+        {
+            if (!readValue(in, e.mode) || !readValue(in, e.firstBlock) || !readValue(in, e.blockCount))
+                return false;
+        }
+        else
+        {
+            // Version 1 has no block ranges; derive them from the stream offsets
+            e.mode = NO_MODE;
+            auto first = upper_bound(blocks.begin(), blocks.end(), e.streamOffset, [](uint64_t pos, const ArchiveBlock &b)
+                                     { return pos < b.streamOffset; });
+            auto last = lower_bound(blocks.begin(), blocks.end(), e.streamOffset + e.size, [](const ArchiveBlock &b, uint64_t pos)
+                                    { return b.streamOffset < pos; });
+            e.firstBlock = static_cast<uint32_t>(first - blocks.begin()) - (first != blocks.begin() ? 1 : 0);
+            e.blockCount = e.size == 0 ? 0 : static_cast<uint32_t>(last - blocks.begin()) - e.firstBlock;
+        }
+        if (static_cast<uint64_t>(e.firstBlock) + e.blockCount > blockCount)
+            return false;
+
+        // The block range must hold all of the file's bytes
+        if (e.size > 0)
+        {
+            if (e.blockCount == 0)
+                return false;
+            const ArchiveBlock &first = blocks[e.firstBlock];
+            const ArchiveBlock &last = blocks[e.firstBlock + e.blockCount - 1];
+            if (e.streamOffset < first.streamOffset || e.streamOffset + e.size > last.streamOffset + last.rawSize)
+                return false;
+        }
+    }
+    return true;
+}
+
+// List the files stored in an archive
+bool listArchive(const string &archiveFile)
+{
+    ifstream in(archiveFile, ios::binary);
+    uint32_t dictId;
+    vector<ArchiveBlock> blocks;
+    vector<ArchiveEntry> entries;
+    if (!in || !readArchiveDirectory(in, dictId, blocks, entries))
+    {
+        cerr << "Error: not a valid archive: " << archiveFile << "\n";
+        return false;
+    }
+    for (const ArchiveEntry &e : entries)
+    {
+        if (e.mode != NO_MODE)
+            cout << oct << setw(4) << setfill('0') << (e.mode & 07777) << dec << setfill(' ') << "  ";
+        cout << setw(12) << e.size << "  " << e.name << "\n";
+    }
+    cout << entries.size() << " files in " << blocks.size() << " blocks\n";
+    return true;
+}
+
+// Decode one archive block and write the parts of the given files it holds
+bool extractBlock(const string &archiveFile, const ArchiveBlock &block, const vector<const ArchiveEntry *> &files,
+                  const string &outDir, const Dictionary *dict)
+{
+    ifstream in(archiveFile, ios::binary);
+    in.seekg(block.offset, ios::beg);
+    vector<unsigned char> data;
+    if (!in || !decompressBlock(in, data, dict) || data.size() != block.rawSize)
+        return false;
+
+    for (const ArchiveEntry *e : files)
+    {
+        uint64_t from = max(e->streamOffset, block.streamOffset);
+        uint64_t to = min(e->streamOffset + e->size, block.streamOffset + block.rawSize);
+        if (from >= to)
+            continue;
+        fstream out(filesystem::path(outDir) / e->name, ios::in | ios::out | ios::binary);
+        out.seekp(from - e->streamOffset, ios::beg);
+        out.write(reinterpret_cast<const char *>(data.data() + (from - block.streamOffset)), to - from);
+        if (!out)
+            return false;
+    }
+    return true;
+}
+
+// Extract all files, or only the named ones, decoding just the blocks they need in parallel
+// and no more at once than fit maxMemory bytes (0 for no limit)
+bool extractArchive(const string &archiveFile, const string &outDir, const vector<string> &names,
+                    const Dictionary *dict, size_t threads, uint64_t maxMemory = 0)
+{
+    ifstream in(archiveFile, ios::binary);
+    uint32_t dictId;
+    vector<ArchiveBlock> blocks;
+    vector<ArchiveEntry> entries;
+    if (!in || !readArchiveDirectory(in, dictId, blocks, entries))
+    {
+        cerr << "Error: not a valid archive: " << archiveFile << "\n";
+        return false;
+    }
+    if (dictId != 0 && (!dict || dict->id != dictId))
+    {
+        cerr << "Error: archive was compressed with a different dictionary (use --dict)!\n";
+        return false;
+    }
+
+    // Create every selected file empty, then fill it block by block
+    vector<vector<const ArchiveEntry *>> blockFiles(blocks.size());
+    vector<const ArchiveEntry *> selected;
+    for (const ArchiveEntry &e : entries)
+    {
+        if (!names.empty() && find(names.begin(), names.end(), e.name) == names.end())
+            continue;
+        if (!isSafeArchiveName(e.name))
+        {
+            cerr << "Skipping unsafe path: " << e.name << "\n";
+            continue;
+        }
+
+        filesystem::path target = filesystem::path(outDir) / e.name;
+        error_code ec;
+        if (target.has_parent_path())
+            filesystem::create_directories(target.parent_path(), ec);
+        ofstream create(target, ios::binary | ios::trunc);
+        create.close();
+        if (!create)
+        {
+            cerr << "Error creating file: " << target.string() << "\n";
+            return false;
+        }
+        for (uint32_t b = e.firstBlock; b < e.firstBlock + e.blockCount; b++)
+            blockFiles[b].push_back(&e);
+        selected.push_back(&e);
+    }
+
+    if (maxMemory > 0)
+    {
+        // The flags byte of each needed block tells whether it is BWT coded
+        uint64_t perBlock = 1;
+        for (size_t b = 0; b < blocks.size(); b++)
+        {
+            if (blockFiles[b].empty())
+                continue;
+            in.clear();
+            in.seekg(blocks[b].offset, ios::beg);
+            perBlock = max(perBlock, blockMemory(blocks[b].rawSize, (in.get() & BLOCK_BWT) != 0));
+        }
+        if (perBlock > maxMemory)
+            cerr << "Warning: blocks of this archive need about " << (perBlock >> 20)
+                 << " MiB each to decode, more than the memory budget\n";
+        threads = static_cast<size_t>(min<uint64_t>(threads, maxMemory / perBlock));
+    }
+    in.close();
+
+    ThreadPool pool(max<size_t>(1, threads));
+    vector<future<bool>> results;
+    for (size_t b = 0; b < blocks.size(); b++)
+    {
+        if (blockFiles[b].empty())
+            continue;
+        results.push_back(pool.submit([&, b]
+                                      { return extractBlock(archiveFile, blocks[b], blockFiles[b], outDir, dict); }));
+    }
+    bool ok = true;
+    for (auto &r : results)
+        ok = r.get() && ok;
+    if (!ok)
+    {
+        // Partly written files are removed rather than left looking complete
+        cerr << "Error: corrupt archive or failed write while extracting!\n";
+        for (const ArchiveEntry *e : selected)
+        {
+            error_code ec;
+            filesystem::remove(filesystem::path(outDir) / e->name, ec);
+        }
+        return false;
+    }
+
+    for (const ArchiveEntry *e : selected)
+    {
+        error_code ec;
+        if (e->mode != NO_MODE)
+            filesystem::permissions(filesystem::path(outDir) / e->name, static_cast<filesystem::perms>(e->mode & 07777), ec);
+    }
+    cout << "Extracted " << selected.size() << " files\n";
+    return true;
+}
+
+void printUsage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [options] c <input> <compressed>\n"
+         << "   or: " << prog << " [--dict <file>] d <compressed> <output>\n"
+         << "   or: " << prog << " [options] a <archive> <file|dir>...\n"
+         << "   or: " << prog << " [options] s <archive> <file|dir>...\n"
+         << "   or: " << prog << " [--dict <file>] [-j <n>] x <archive> <outdir> [name]...\n"
+         << "   or: " << prog << " l <archive>\n"
+         << "   or: " << prog << " train <dictionary> <sample>...\n"
+         << "Options:\n"
+         << "  --bwt              Burrows-Wheeler + move-to-front before Huffman coding\n"
+         << "  --rle              run-length pre-pass on blocks where it helps\n"
+         << "  --block-size <n>   block size in bytes, k/m suffix allowed (default 1m, at most 16m)\n"
+         << "  --no-static-tables always store a per-block Huffman table\n"
+         << "  --dict <file>      prime compression with a trained dictionary\n"
+         << "  -j <n>             worker threads (default: all cores)\n"
+         << "  --max-memory <n>   memory budget in bytes, k/m/g suffix allowed; lowers threads and\n"
+         << "                     block size to fit (mode d warns about blocks over it), and\n"
+         << "                     reports the peak at the end\n"
+         << "  --stats            print per-phase timing and throughput to stderr (modes c and d)\n"
+         << "  --stats-json       the same as JSON\n"
+         << "  --stats-blocks     include one entry per block in the statistics\n"
+         << "  --trace <file>     write a Chrome/Perfetto trace of the block phases (modes c and d)\n"
+         << "  --progress <mode>  text (default), json (one object per line) or none (modes c and d)\n"
+         << "Modes a and s create an archive with one block range per file or solid blocks.\n";
+}
+
+int main(int argc, char *argv[])
+{
+    CompressOptions opts;
+    string dictFile;
+    bool stats = false, statsJson = false, statsBlocks = false;
+    string traceFile;
+    uint64_t maxMemory = 0;
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--bwt")
+        {
+            opts.bwt = true;
+        }
+        else if (arg == "--rle")
+        {
+            opts.rle = true;
+        }
+        else if (arg == "--no-static-tables")
+        {
+            opts.staticTables = false;
+        }
+        else if (arg == "--block-size" && i + 1 < argc)
+        {
+            opts.blockSize = parseSize(argv[++i]);
+            if (opts.blockSize == 0 || opts.blockSize > MAX_BLOCK_SIZE)
+            {
+                cerr << "Invalid block size: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "--stats")
+        {
+            stats = true;
+        }
+        else if (arg == "--stats-json")
+        {
+            stats = statsJson = true;
+        }
+        else if (arg == "--stats-blocks")
+        {
+            stats = statsBlocks = true;
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
+        else if (arg == "--progress" && i + 1 < argc)
+        {
+            string value = argv[++i];
+            if (value != "text" && value != "json" && value != "none")
+            {
+                cerr << "Invalid progress mode: " << value << "\n";
+                return 1;
+            }
+            opts.progress = value == "text" ? PROGRESS_TEXT : value == "json" ? PROGRESS_JSON : PROGRESS_NONE;
+        }
+        else if (arg == "--dict" && i + 1 < argc)
+        {
+            dictFile = argv[++i];
+        }
+        else if (arg == "--max-memory" && i + 1 < argc)
+        {
+            maxMemory = parseSize(argv[++i]);
+            if (maxMemory == 0)
+            {
+                cerr << "Invalid memory budget: " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if (arg == "-j" && i + 1 < argc)
+        {
+            int threads = atoi(argv[++i]);
+            if (threads < 1)
+            {
+                cerr << "Invalid thread count: " << argv[i] << "\n";
+                return 1;
+            }
+            opts.threads = threads;
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    bool variadic = !args.empty() && (args[0] == "train" || args[0] == "a" || args[0] == "s" || args[0] == "x");
+    bool listing = args.size() == 2 && args[0] == "l";
+    if (!listing && (args.size() < 3 || (!variadic && args.size() != 3)))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    string mode = args[0];
+    string first = args[1];
+    string second = listing ? "" : args[2];
+    vector<string> rest(args.begin() + min<size_t>(args.size(), 3), args.end());
+
+    Dictionary dict;
+    if (!dictFile.empty())
+    {
+        if (!loadDictionary(dictFile, dict))
+        {
+            cerr << "Error loading dictionary: " << dictFile << "\n";
+            return 1;
+        }
+        opts.dict = &dict;
+    }
+
+    if (maxMemory > 0 && (mode == "c" || mode == "a" || mode == "s"))
+    {
+        size_t threads = opts.threads, blockSize = opts.blockSize;
+        if (!fitMemoryBudget(opts, maxMemory))
+        {
+            cerr << "Error: memory budget too small (" << maxMemory << " bytes)\n";
+            return 1;
+        }
+        if (opts.threads != threads || opts.blockSize != blockSize)
+            cerr << "Memory budget: using " << opts.threads << " threads and " << opts.blockSize
+                 << " byte blocks\n";
+    }
+
+    Stats runStats;
+    Trace trace("block", true);
+    Trace *tracing = traceFile.empty() ? nullptr : &trace;
+    if (mode == "c")
+    {
+        opts.stats = stats ? &runStats : nullptr;
+        opts.trace = tracing;
+        if (!compressFile(first, second, opts))
+            return 1;
+    }
+    else if (mode == "d")
+    {
+        runStats.compress = false;
+        if (!decompressFile(first, second, opts.dict, stats ? &runStats : nullptr, tracing, opts.progress, maxMemory))
+            return 1;
+    }
+    else if (mode == "train")
+    {
+        if (!trainDictionary(vector<string>(args.begin() + 2, args.end()), first))
+            return 1;
+    }
+    else if (mode == "a" || mode == "s")
+    {
+        if (!createArchive(first, vector<string>(args.begin() + 2, args.end()), opts, mode == "s"))
+            return 1;
+    }
+    else if (mode == "x")
+    {
+        if (!extractArchive(first, second, rest, opts.dict, opts.threads, maxMemory))
+            return 1;
+    }
+    else if (mode == "l")
+    {
+        if (!listArchive(first))
+            return 1;
+    }
+    else
+    {
+        cerr << "Unknown mode: " << mode << " (use c, d, a, s, x, l or train)\n";
+        return 1;
+    }
+
+    if (stats && (mode == "c" || mode == "d"))
+        printStats(cerr, runStats, statsJson, statsBlocks);
+    if (maxMemory > 0)
+    {
+        uint64_t peak = peakMemory();
+        cerr << "Peak memory: " << peak << " bytes (budget " << maxMemory << " bytes)\n";
+        if (peak > maxMemory)
+            cerr << "Warning: peak memory exceeded the budget\n";
+    }
+    if (tracing && (mode == "c" || mode == "d") && !trace.write(traceFile))
+    {
+        cerr << "Error writing trace: " << traceFile << "\n";
+        return 1;
+    }
     return 0;
 }
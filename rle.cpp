@@ -1,34 +1,259 @@
 #include <iostream>
 #include <string>
 #include <fstream>
-#include <sstream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include "tooling.h"
 
 using namespace std;
 
+// Decimal digit pairs "00" to "99", indexed by 2 * value
+const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Write value in decimal at out, two digits per step, and return the end
+inline char *writeCount(char *out, uint64_t value)
+{
+    if (value < 10)
+    {
+        *out = static_cast<char>('0' + value);
+        return out + 1;
+    }
+
+    char digits[20];
+    char *p = digits + sizeof(digits);
+    while (value >= 100)
+    {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + 2 * (value % 100), 2);
+        value /= 100;
+    }
+    if (value >= 10)
+    {
+        p -= 2;
+        memcpy(p, DIGIT_PAIRS + 2 * value, 2);
+    }
+    else
+    {
+        *--p = static_cast<char>('0' + value);
+    }
+
+    size_t length = static_cast<size_t>(digits + sizeof(digits) - p);
+    memcpy(out, p, length);
+    return out + length;
+}
+
+// Index of the first nonzero byte of a word loaded from memory
+inline size_t firstNonzeroByte(uint64_t word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return static_cast<size_t>(__builtin_clzll(word)) / 8;
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return index / 8;
+#else
+    return static_cast<size_t>(__builtin_ctzll(word)) / 8;
+#endif
+}
+
+// Length of the run of data[pos] starting at pos; compares eight bytes per step
+size_t runLength(const char *data, size_t pos, size_t n)
+{
+    uint64_t pattern = 0x0101010101010101ULL * static_cast<uint8_t>(data[pos]);
+    size_t i = pos + 1;
+    while (i + 8 <= n)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        if (word != pattern)
+            return i - pos + firstNonzeroByte(word ^ pattern);
+        i += 8;
+    }
+    while (i < n && data[i] == data[pos])
+        i++;
+    return i - pos;
+}
+
+/*
+ * Streaming
+ *
+ * Files are encoded and decoded in STREAM_CHUNK_SIZE pieces, so memory stays
+ * constant however large the file or its runs are. The encoder holds the last
+ * run of a chunk in its state, since it may continue in the next chunk; the
+ * decoder holds a count that was cut off at the end of a chunk. Counts are
+ * 64-bit on both sides.
+ */
+const size_t STREAM_CHUNK_SIZE = 1 << 22; // 4 MiB
+const size_t MAX_RUN_TOKEN = 21;          // 20-digit count + character
+
+// Run carried between chunks by the encoder
+struct TextEncoderState
+{
+    char runChar = 0;
+    uint64_t runLength = 0;
+};
+
+// Write the pending run of state at out and return the end
+inline char *finishRun(TextEncoderState &state, char *out)
+{
+    if (state.runLength == 0)
+        return out;
+    out = writeCount(out, state.runLength);
+    *out++ = state.runChar;
+    state.runLength = 0;
+    return out;
+}
+
+// Encode data[0, n) at out and return the end. The last run stays pending in
+// state; finishRun writes it once the input is done. A run of length L takes
+// at most 2 * L bytes (d count digits need L >= 10^(d-1)), so out needs room
+// for 2 * n bytes, plus MAX_RUN_TOKEN if a run was carried in from before
+char *encodeTextChunk(TextEncoderState &state, const char *data, size_t n, char *out)
+{
+    for (size_t i = 0; i < n;)
+    {
+        size_t length = runLength(data, i, n);
+        if (data[i] != state.runChar || state.runLength == 0)
+        {
+            out = finishRun(state, out);
+            state.runChar = data[i];
+        }
+        state.runLength += length;
+        i += length;
+    }
+    return out;
+}
+
 // RLE Compression: Encodes consecutive repeated characters as count + character
 string rleCompress(const string &input)
 {
     if (input.empty())
         return "";
 
-    string compressed;
-    int count = 1;
+    // Allocated once at the worst-case size
+    string compressed(2 * input.size(), '\0');
+    TextEncoderState state;
+    char *out = encodeTextChunk(state, input.data(), input.size(), &compressed[0]);
+    out = finishRun(state, out);
+
+    compressed.resize(static_cast<size_t>(out - compressed.data()));
+    return compressed;
+}
 
-    for (size_t i = 1; i <= input.length(); i++)
+// Count carried between chunks by the decoder when a chunk ends inside it
+struct TextDecoderState
+{
+    uint64_t count = 0;
+    bool inCount = false;
+};
+
+// Decode data[0, n), calling run(character, count) for each run. A count at
+// the end of the data is kept in state for the next chunk; after the last one,
+// state.inCount means the input ended inside a count. Like stoi before it,
+// throws on a missing or oversized count
+template <typename Run>
+void decodeTextChunk(TextDecoderState &state, const char *data, size_t n, Run run)
+{
+    for (size_t pos = 0; pos < n; pos++)
     {
-        if (i < input.length() && input[i] == input[i - 1])
-        {
-            count++;
-        }
-        else
+        unsigned digit;
+        while (pos < n && (digit = static_cast<unsigned char>(data[pos]) - '0') < 10)
         {
-            // Append count and character
-            compressed += to_string(count) + input[i - 1];
-            count = 1;
+            if (state.count > (UINT64_MAX - digit) / 10)
+                throw out_of_range("rleDecompress: run count too large");
+            state.count = state.count * 10 + digit;
+            state.inCount = true;
+            pos++;
         }
+        if (pos == n)
+            break;
+        if (!state.inCount)
+            throw invalid_argument("rleDecompress: missing run count");
+
+        run(data[pos], state.count);
+        state.count = 0;
+        state.inCount = false;
     }
+}
 
-    return compressed;
+/*
+ * Stored files
+ *
+ * Isolated characters double in size ("x" becomes "1x"), so before compressing
+ * a file ESTIMATE_SAMPLES evenly spaced samples of it are encoded. If they
+ * come to more than the store threshold of their raw size, the file is written
+ * as STORED_TAG followed by its raw bytes. Encoded data always starts with a
+ * digit, so the tag cannot be mistaken for it. Digits in the input would read
+ * back as counts, so a file holding any is stored as well.
+ */
+const string STORED_TAG = "#RAW";
+const size_t ESTIMATE_SAMPLES = 32;
+const size_t ESTIMATE_SAMPLE_SIZE = 1 << 14; // 16 KiB
+const double DEFAULT_STORE_ABOVE = 0.95;     // Store raw above this estimated ratio
+
+// True if the data starts with STORED_TAG
+inline bool isStored(const char *data, size_t n)
+{
+    return n >= STORED_TAG.size() && memcmp(data, STORED_TAG.data(), STORED_TAG.size()) == 0;
+}
+
+// True if the data holds a digit, which the count + character format cannot represent
+inline bool hasDigit(const char *data, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (static_cast<unsigned char>(data[i] - '0') < 10)
+            return true;
+    }
+    return false;
+}
+
+// Estimated compressed size / input size of a file, from encoding samples of
+// it; rewinds the file
+double estimateRatio(istream &in)
+{
+    TraceSpan span("estimate", 0);
+    in.seekg(0, ios::end);
+    uint64_t size = static_cast<uint64_t>(in.tellg());
+    size_t sampleSize = static_cast<size_t>(min<uint64_t>(size, ESTIMATE_SAMPLE_SIZE));
+    uint64_t samples = sampleSize == 0 ? 0 : min<uint64_t>(ESTIMATE_SAMPLES, size / sampleSize);
+
+    vector<char> sample(sampleSize);
+    vector<char> encoded(2 * sampleSize);
+    uint64_t sampled = 0, estimate = 0;
+    for (uint64_t s = 0; s < samples; s++)
+    {
+        // The first sample starts the file and the last one ends it
+        uint64_t offset = samples == 1 ? 0 : (size - sampleSize) / (samples - 1) * s;
+        in.seekg(static_cast<streamoff>(offset), ios::beg);
+        in.read(sample.data(), sampleSize);
+        size_t got = static_cast<size_t>(in.gcount());
+
+        TextEncoderState state;
+        char *end = encodeTextChunk(state, sample.data(), got, encoded.data());
+        end = finishRun(state, end);
+        estimate += static_cast<uint64_t>(end - encoded.data());
+        sampled += got;
+    }
+
+    in.clear();
+    in.seekg(0, ios::beg);
+    return sampled == 0 ? 1.0 : static_cast<double>(estimate) / sampled;
 }
 
 // RLE Decompression: Decodes count + character back to original string
@@ -36,29 +261,95 @@ string rleDecompress(const string &compressed)
 {
     if (compressed.empty())
         return "";
+    if (isStored(compressed.data(), compressed.size()))
+        return compressed.substr(STORED_TAG.size());
 
+    // First pass sums the counts, so the output is allocated once at its exact size
     string decompressed;
-    string countStr;
+    uint64_t total = 0;
+    TextDecoderState sizing;
+    decodeTextChunk(sizing, compressed.data(), compressed.size(), [&](char, uint64_t count)
+                    {
+        if (count > decompressed.max_size() - total)
+            throw length_error("rleDecompress: output too large");
+        total += count; });
+
+    // Second pass fills the runs
+    decompressed.resize(static_cast<size_t>(total));
+    char *out = &decompressed[0];
+    TextDecoderState state;
+    decodeTextChunk(state, compressed.data(), compressed.size(), [&](char c, uint64_t count)
+                    {
+        if (count == 1)
+            *out++ = c;
+        else
+        {
+            memset(out, c, static_cast<size_t>(count));
+            out += count;
+        } });
 
-    for (size_t i = 0; i < compressed.length(); i++)
+    return decompressed;
+}
+
+// Buffers decoded output and writes it in chunk-sized pieces, so a run of
+// any length needs at most one chunk of memory
+struct ChunkWriter
+{
+    ostream &out;
+    vector<char> buffer;
+    size_t used = 0;
+    uint64_t written = 0;
+
+    ChunkWriter(ostream &out, size_t chunkSize) : out(out), buffer(chunkSize) {}
+
+    void fill(char c, uint64_t count)
     {
-        if (isdigit(compressed[i]))
+        if (count == 1 && used < buffer.size())
         {
-            countStr += compressed[i];
+            buffer[used++] = c;
+            return;
         }
-        else
+        while (count > 0)
         {
-            int count = stoi(countStr);
-            decompressed += string(count, compressed[i]);
-            countStr.clear();
+            if (used == buffer.size())
+                flush();
+            size_t take = static_cast<size_t>(min<uint64_t>(count, buffer.size() - used));
+            memset(buffer.data() + used, c, take);
+            used += take;
+            count -= take;
         }
     }
 
-    return decompressed;
-}
+    // Write data through unbuffered
+    void append(const char *data, size_t length)
+    {
+        flush();
+        out.write(data, length);
+        written += length;
+    }
 
-// Compress a file and save to output file
-bool compressFile(const string &inputFile, const string &outputFile)
+    bool flush()
+    {
+        out.write(buffer.data(), used);
+        written += used;
+        used = 0;
+        return out.good();
+    }
+};
+
+// Byte counts of a compressFile/decompressFile call
+struct FileResult
+{
+    uint64_t inputSize = 0;
+    uint64_t outputSize = 0;
+    bool stored = false; // Copied raw because RLE would not pay off
+};
+
+// Compress a file and save to output file, one chunk at a time. If the
+// estimated ratio is above storeAbove, the file is stored raw instead. False
+// (with the output removed) on failure
+bool compressFile(const string &inputFile, const string &outputFile, FileResult &result,
+                  double storeAbove = DEFAULT_STORE_ABOVE, size_t chunkSize = STREAM_CHUNK_SIZE)
 {
     ifstream inFile(inputFile, ios::binary);
     if (!inFile)
@@ -67,16 +358,6 @@ bool compressFile(const string &inputFile, const string &outputFile)
         return false;
     }
 
-    // Read entire file content
-    stringstream buffer;
-    buffer << inFile.rdbuf();
-    string content = buffer.str();
-    inFile.close();
-
-    // Compress the content
-    string compressed = rleCompress(content);
-
-    // Write compressed data to output file
     ofstream outFile(outputFile, ios::binary);
     if (!outFile)
     {
@@ -84,19 +365,75 @@ bool compressFile(const string &inputFile, const string &outputFile)
         return false;
     }
 
-    outFile << compressed;
-    outFile.close();
+    vector<char> chunk(chunkSize);
+    result.stored = estimateRatio(inFile) > storeAbove;
+    if (result.stored)
+    {
+        outFile << STORED_TAG;
+        result.outputSize = STORED_TAG.size();
+    }
 
-    cout << "Compression complete!" << endl;
-    cout << "Original size: " << content.size() << " bytes" << endl;
-    cout << "Compressed size: " << compressed.size() << " bytes" << endl;
-    cout << "Compression ratio: " << (compressed.size() * 100.0 / content.size()) << "%" << endl;
+    vector<char> encoded(2 * chunkSize + MAX_RUN_TOKEN);
+    TextEncoderState state;
+    for (uint64_t index = 0;; index++)
+    {
+        {
+            TraceSpan span("read", index);
+            inFile.read(chunk.data(), chunk.size());
+        }
+        size_t got = static_cast<size_t>(inFile.gcount());
+        if (inFile.bad())
+        {
+            cerr << "Error: Failed to read input file: " << inputFile << endl;
+            return discardOutput(outFile, outputFile);
+        }
+
+        // On the first digit, start over and store the file
+        if (!result.stored && hasDigit(chunk.data(), got))
+        {
+            outFile.close();
+            outFile.open(outputFile, ios::binary | ios::trunc);
+            outFile << STORED_TAG;
+            result.inputSize = 0;
+            result.outputSize = STORED_TAG.size();
+            result.stored = true;
+            inFile.clear();
+            inFile.seekg(0, ios::beg);
+            continue;
+        }
+        result.inputSize += got;
 
+        const char *data = chunk.data();
+        size_t length = got;
+        if (!result.stored)
+        {
+            TraceSpan span("encode", index);
+            char *end = encodeTextChunk(state, chunk.data(), got, encoded.data());
+            if (!inFile)
+                end = finishRun(state, end);
+            data = encoded.data();
+            length = static_cast<size_t>(end - encoded.data());
+        }
+        {
+            TraceSpan span("write", index);
+            outFile.write(data, length);
+        }
+        result.outputSize += length;
+        if (!outFile)
+        {
+            cerr << "Error: Failed to write output file: " << outputFile << endl;
+            return discardOutput(outFile, outputFile);
+        }
+        if (!inFile)
+            break;
+    }
     return true;
 }
 
-// Decompress a file and save to output file
-bool decompressFile(const string &inputFile, const string &outputFile)
+// Decompress a file and save to output file, one chunk at a time; false (with
+// the output removed) on failure
+bool decompressFile(const string &inputFile, const string &outputFile, FileResult &result,
+                    size_t chunkSize = STREAM_CHUNK_SIZE)
 {
     ifstream inFile(inputFile, ios::binary);
     if (!inFile)
@@ -105,16 +442,6 @@ bool decompressFile(const string &inputFile, const string &outputFile)
         return false;
     }
 
-    // Read entire file content
-    stringstream buffer;
-    buffer << inFile.rdbuf();
-    string content = buffer.str();
-    inFile.close();
-
-    // Decompress the content
-    string decompressed = rleDecompress(content);
-
-    // Write decompressed data to output file
     ofstream outFile(outputFile, ios::binary);
     if (!outFile)
     {
@@ -122,17 +449,180 @@ bool decompressFile(const string &inputFile, const string &outputFile)
         return false;
     }
 
-    outFile << decompressed;
-    outFile.close();
+    vector<char> chunk(chunkSize);
+    ChunkWriter writer(outFile, chunkSize);
+    TextDecoderState state;
+    bool stored = false;
+    for (uint64_t index = 0; inFile; index++)
+    {
+        {
+            TraceSpan span("read", index);
+            inFile.read(chunk.data(), chunk.size());
+        }
+        size_t got = static_cast<size_t>(inFile.gcount());
+        if (inFile.bad())
+        {
+            cerr << "Error: Failed to read input file: " << inputFile << endl;
+            return discardOutput(outFile, outputFile);
+        }
+
+        // A stored file is copied after its tag
+        size_t skip = 0;
+        if (result.inputSize == 0 && isStored(chunk.data(), got))
+        {
+            stored = true;
+            skip = STORED_TAG.size();
+        }
+        result.inputSize += got;
+        if (stored)
+        {
+            TraceSpan span("write", index);
+            writer.append(chunk.data() + skip, got - skip);
+            continue;
+        }
 
-    cout << "Decompression complete!" << endl;
-    cout << "Compressed size: " << content.size() << " bytes" << endl;
-    cout << "Decompressed size: " << decompressed.size() << " bytes" << endl;
+        // Malformed counts throw. Includes writing, which ChunkWriter does as its buffer fills
+        try
+        {
+            TraceSpan span("decode", index);
+            decodeTextChunk(state, chunk.data(), got, [&](char c, uint64_t count)
+                            { writer.fill(c, count); });
+        }
+        catch (const exception &)
+        {
+            cerr << "Error: Corrupt compressed file: " << inputFile << endl;
+            return discardOutput(outFile, outputFile);
+        }
+    }
+
+    // A count with no character after it means the file was cut short
+    if (state.inCount)
+    {
+        cerr << "Error: Corrupt compressed file: " << inputFile << endl;
+        return discardOutput(outFile, outputFile);
+    }
 
+    bool ok = writer.flush();
+    result.outputSize = writer.written;
+    if (!ok)
+    {
+        cerr << "Error: Failed to write output file: " << outputFile << endl;
+        return discardOutput(outFile, outputFile);
+    }
     return true;
 }
 
-int main()
+/*
+ * Memory budget (--max-memory)
+ *
+ * Compressing holds a chunk and its encoding, which can be twice as long;
+ * decompressing holds a chunk and a write buffer of the same size. A budget is
+ * met by running fewer files at once and then by using smaller chunks.
+ */
+const uint64_t CHUNK_MEMORY_FACTOR = 3;
+const size_t MIN_BUDGET_CHUNK_SIZE = 1 << 16; // 64 KiB
+
+// Largest chunk size up to STREAM_CHUNK_SIZE whose buffers fit maxMemory bytes
+// (0 for no limit); 0 if not even MIN_BUDGET_CHUNK_SIZE fits
+size_t budgetChunkSize(uint64_t maxMemory)
+{
+    if (maxMemory == 0)
+        return STREAM_CHUNK_SIZE;
+    size_t chunkSize = static_cast<size_t>(min<uint64_t>(STREAM_CHUNK_SIZE, maxMemory / CHUNK_MEMORY_FACTOR));
+    return chunkSize < MIN_BUDGET_CHUNK_SIZE ? 0 : chunkSize;
+}
+
+/*
+ * Batch mode
+ *
+ * "c" and "d" take any number of files and process up to -j of them at once.
+ * Each file gets one status line on stdout; the exit code is 0 if every file
+ * succeeded, 1 if any failed and 2 on a usage error.
+ */
+const string COMPRESSED_SUFFIX = ".rle";
+
+// Output name for a batch input: add the suffix, or strip it when decompressing
+string batchOutputName(const string &input, bool compress)
+{
+    if (compress)
+        return input + COMPRESSED_SUFFIX;
+    size_t n = COMPRESSED_SUFFIX.size();
+    if (input.size() > n && input.compare(input.size() - n, n, COMPRESSED_SUFFIX) == 0)
+        return input.substr(0, input.size() - n);
+    return input + ".out";
+}
+
+// Compress or decompress every file on up to jobs threads; returns the number of failures.
+// With a memory budget, fewer files run at once if each could not use a full chunk
+size_t runBatch(const vector<string> &files, const string &output, bool compress, size_t jobs, double storeAbove,
+                uint64_t maxMemory = 0)
+{
+    size_t workers = min(jobs, files.size());
+    if (maxMemory > 0)
+        workers = static_cast<size_t>(
+            max<uint64_t>(1, min<uint64_t>(workers, maxMemory / (CHUNK_MEMORY_FACTOR * STREAM_CHUNK_SIZE))));
+    size_t chunkSize = budgetChunkSize(maxMemory / workers);
+    if (chunkSize == 0)
+    {
+        cerr << "Error: Memory budget too small (" << maxMemory << " bytes)" << endl;
+        return files.size();
+    }
+
+    atomic<size_t> next{0};
+    atomic<size_t> failures{0};
+    mutex printLock;
+
+    // Each worker takes the next unclaimed file until none are left
+    auto worker = [&]
+    {
+        for (size_t i = next++; i < files.size(); i = next++)
+        {
+            const string &file = files[i];
+            string target = output.empty() ? batchOutputName(file, compress) : output;
+            FileResult result;
+            bool ok = compress ? compressFile(file, target, result, storeAbove, chunkSize)
+                               : decompressFile(file, target, result, chunkSize);
+            if (!ok)
+                failures++;
+
+            lock_guard<mutex> lock(printLock);
+            if (ok)
+                cout << "ok      " << file << " -> " << target << " (" << result.inputSize << " -> "
+                     << result.outputSize << " bytes" << (result.stored ? ", stored" : "") << ")" << endl;
+            else
+                cout << "FAILED  " << file << endl;
+        }
+    };
+
+    vector<thread> threads;
+    for (size_t t = 0; t < workers; t++)
+        threads.emplace_back(worker);
+    for (thread &t : threads)
+        t.join();
+    return failures;
+}
+
+void printUsage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [options] c <file>...\n"
+         << "   or: " << prog << " [options] d <file>...\n"
+         << "   or: " << prog << "   (no arguments: interactive menu)\n"
+         << "Options:\n"
+         << "  -j <n>      files processed at once (default: all cores)\n"
+         << "  -o <file>   output name, for a single input file\n"
+         << "  --trace <file>\n"
+         << "              write a Chrome/Perfetto trace of the chunk work\n"
+         << "  --store-above <pct>\n"
+         << "              store files raw if RLE is estimated above pct% of their size\n"
+         << "              (default " << DEFAULT_STORE_ABOVE * 100 << ")\n"
+         << "  --max-memory <n>\n"
+         << "              memory budget in bytes, k/m/g suffix allowed; lowers the files\n"
+         << "              processed at once and the chunk size to fit, and reports the peak\n"
+         << "Mode c writes <file>" << COMPRESSED_SUFFIX << ", mode d strips the suffix (or adds .out).\n";
+}
+
+// Interactive menu
+int runMenu()
 {
     int choice;
     string input, output;
@@ -148,7 +638,8 @@ int main()
     while (true)
     {
         cout << "\nEnter choice (1-5): ";
-        cin >> choice;
+        if (!(cin >> choice))
+            return 0;
         cin.ignore(); // Clear newline from buffer
 
         switch (choice)
@@ -177,7 +668,16 @@ int main()
             getline(cin, input);
             cout << "Enter output file path: ";
             getline(cin, output);
-            compressFile(input, output);
+            FileResult result;
+            if (compressFile(input, output, result))
+            {
+                cout << "Compression complete!" << endl;
+                cout << "Original size: " << result.inputSize << " bytes" << endl;
+                cout << "Compressed size: " << result.outputSize << " bytes" << endl;
+                cout << "Compression ratio: " << (result.outputSize * 100.0 / result.inputSize) << "%" << endl;
+                if (result.stored)
+                    cout << "Stored uncompressed: sampling predicted RLE would not save space" << endl;
+            }
             break;
         }
         case 4:
@@ -186,7 +686,13 @@ int main()
             getline(cin, input);
             cout << "Enter output file path: ";
             getline(cin, output);
-            decompressFile(input, output);
+            FileResult result;
+            if (decompressFile(input, output, result))
+            {
+                cout << "Decompression complete!" << endl;
+                cout << "Compressed size: " << result.inputSize << " bytes" << endl;
+                cout << "Decompressed size: " << result.outputSize << " bytes" << endl;
+            }
             break;
         }
         case 5:
@@ -201,3 +707,86 @@ int main()
 
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    if (argc == 1)
+        return runMenu();
+
+    size_t jobs = max(1u, thread::hardware_concurrency());
+    double storeAbove = DEFAULT_STORE_ABOVE;
+    uint64_t maxMemory = 0;
+    string output, traceFile;
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1)
+            {
+                cerr << "Invalid thread count: " << argv[i] << endl;
+                return 2;
+            }
+            jobs = static_cast<size_t>(n);
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
+        else if (arg == "--store-above" && i + 1 < argc)
+        {
+            double pct = atof(argv[++i]);
+            if (pct <= 0)
+            {
+                cerr << "Invalid store threshold: " << argv[i] << endl;
+                return 2;
+            }
+            storeAbove = pct / 100;
+        }
+        else if (arg == "--max-memory" && i + 1 < argc)
+        {
+            maxMemory = parseSize(argv[++i]);
+            if (maxMemory == 0)
+            {
+                cerr << "Invalid memory budget: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() < 2 || (args[0] != "c" && args[0] != "d") || (!output.empty() && args.size() != 2))
+    {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    Trace trace;
+    if (!traceFile.empty())
+        activeTrace = &trace;
+
+    vector<string> files(args.begin() + 1, args.end());
+    size_t failures = runBatch(files, output, args[0] == "c", jobs, storeAbove, maxMemory);
+    if (maxMemory > 0)
+    {
+        uint64_t peak = peakMemory();
+        cerr << "Peak memory: " << peak << " bytes (budget " << maxMemory << " bytes)" << endl;
+        if (peak > maxMemory)
+            cerr << "Warning: peak memory exceeded the budget" << endl;
+    }
+    if (activeTrace && !trace.write(traceFile))
+    {
+        cerr << "Error writing trace: " << traceFile << endl;
+        return 1;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -3,231 +3,1611 @@
 #include <fstream>
 #include <vector>
 #include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <chrono>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "tooling.h"
 
 using namespace std;
 
 /*
  * Binary-Safe RLE Compression Algorithm
  *
- * Format: Uses escape byte (0xFF) to mark compressed runs
- * - For runs of 4+ identical bytes: [0xFF][count][byte]
- * - For literal bytes: output as-is (escape 0xFF as 0xFF 0x00)
- * - Count is stored as 1 byte (max run = 255)
+ * Format: Uses an escape byte to mark compressed runs
+ * - For runs of 4+ identical bytes: [escape][count][byte]
+ * - For literal bytes: output as-is (escape byte as [escape][0x00])
+ * - Count is a LEB128 varint, so a run of any length is one triple
+ * - The escape is the least frequent byte of the input, so literals
+ *   rarely need escaping
+ *
+ * Streams start with FORMAT_MAGIC, a version byte and (version 3) the escape
+ * byte. The magic begins with 0xFF 0x01, which the original headerless
+ * format (version 1, escape 0xFF, count stored as 1 byte, max run = 255) can
+ * never produce, so old files still decode. Version 2 used a fixed 0xFF
+ * escape with varint counts. Version 4 is a chunked container of independent
+ * version 3 bodies, described further down.
+ *
+ * Version 5 (PackBits style) has no escape byte. The stream is a sequence of
+ * varint headers h: if the low bit is clear, (h >> 1) + 1 literal bytes
+ * follow (at most MAX_LITERAL_RUN); if set, one byte follows that repeats
+ * (h >> 1) + MIN_RUN_LENGTH times. Decoding is one memcpy per literal run and
+ * one memset per repeat run, with no per-byte escape checks.
+ *
+ * Version 6 is the raw input behind the header, written when sampling
+ * predicts that RLE would not save enough space (see estimateRatio).
  */
 
-const uint8_t ESCAPE_BYTE = 0xFF;
+const uint8_t ESCAPE_BYTE = 0xFF; // Escape of versions 1 and 2
 const int MIN_RUN_LENGTH = 4; // Minimum run length to compress
 
-// Binary-safe RLE Compression
-vector<uint8_t> rleCompressBinary(const vector<uint8_t> &input)
+const uint8_t FORMAT_MAGIC[4] = {ESCAPE_BYTE, 0x01, 'R', 'B'};
+const uint8_t FORMAT_LEGACY = 1;
+const uint8_t FORMAT_VARINT = 2;
+const uint8_t FORMAT_ADAPTIVE_ESCAPE = 3;
+const uint8_t FORMAT_PACKBITS = 5;
+const uint8_t FORMAT_STORED = 6;
+const uint8_t DEFAULT_FORMAT = FORMAT_PACKBITS; // Format of newly written streams
+const size_t MAX_LITERAL_RUN = 1 << 16; // Longest version 5 literal run
+
+/*
+ * Run and escape scanning
+ *
+ * The compressor looks for the next "special" position: an escape byte, or
+ * the start of MIN_RUN_LENGTH identical bytes. Everything before it is a
+ * plain literal span and is copied in bulk. With SSE2/AVX2 the scanners test
+ * 16/32 positions per step with compare + movemask + count-trailing-zeros.
+ */
+static_assert(MIN_RUN_LENGTH == 4, "specialMask compares exactly four shifted loads");
+
+inline int countTrailingZeros(uint32_t mask)
 {
-    if (input.empty())
-        return {};
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
 
-    vector<uint8_t> compressed;
+#if defined(__AVX2__)
+const size_t SCAN_WIDTH = 32;
+typedef __m256i ScanVector;
+
+inline ScanVector broadcast(uint8_t b) { return _mm256_set1_epi8(static_cast<char>(b)); }
+
+// Bit i set if data[i] == value
+inline uint32_t equalMask(const uint8_t *data, ScanVector value)
+{
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, value)));
+}
+
+// Bit i set if data[i] starts MIN_RUN_LENGTH equal bytes
+inline uint32_t runMask(const uint8_t *data)
+{
+    __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data));
+    __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 1));
+    __m256i v2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 2));
+    __m256i v3 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + 3));
+    __m256i run = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v0, v1), _mm256_cmpeq_epi8(v1, v2)),
+                                   _mm256_cmpeq_epi8(v2, v3));
+    return static_cast<uint32_t>(_mm256_movemask_epi8(run));
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+const size_t SCAN_WIDTH = 16;
+typedef __m128i ScanVector;
+
+inline ScanVector broadcast(uint8_t b) { return _mm_set1_epi8(static_cast<char>(b)); }
+
+// Bit i set if data[i] == value
+inline uint32_t equalMask(const uint8_t *data, ScanVector value)
+{
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, value)));
+}
+
+// Bit i set if data[i] starts MIN_RUN_LENGTH equal bytes
+inline uint32_t runMask(const uint8_t *data)
+{
+    __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+    __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 1));
+    __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 2));
+    __m128i v3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 3));
+    __m128i run = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, v1), _mm_cmpeq_epi8(v1, v2)),
+                                _mm_cmpeq_epi8(v2, v3));
+    return static_cast<uint32_t>(_mm_movemask_epi8(run));
+}
+#else
+const size_t SCAN_WIDTH = 0;
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+// Bit i set if data[i] is an escape byte or starts MIN_RUN_LENGTH equal bytes
+inline uint32_t specialMask(const uint8_t *data, ScanVector escape)
+{
+    return runMask(data) | equalMask(data, escape);
+}
+#endif
+
+// Length of the run of value starting at pos, not looking past end
+size_t countRun(const uint8_t *data, size_t pos, size_t end, uint8_t value)
+{
+    size_t i = pos;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    ScanVector v = broadcast(value);
+    const uint32_t full = SCAN_WIDTH == 32 ? 0xFFFFFFFFu : 0xFFFFu;
+    while (i + SCAN_WIDTH <= end)
+    {
+        uint32_t mask = equalMask(data + i, v);
+        if (mask != full)
+            return i - pos + countTrailingZeros(~mask);
+        i += SCAN_WIDTH;
+    }
+#endif
+    while (i < end && data[i] == value)
+        i++;
+    return i - pos;
+}
+
+// True if MIN_RUN_LENGTH identical bytes start at pos
+inline bool isRunStart(const uint8_t *data, size_t pos, size_t n)
+{
+    return pos + MIN_RUN_LENGTH <= n && data[pos] == data[pos + 1] &&
+           data[pos] == data[pos + 2] && data[pos] == data[pos + 3];
+}
+
+// First position at or after pos holding the escape byte or starting a run; n if none
+size_t findSpecial(const uint8_t *data, size_t pos, size_t n, uint8_t escapeByte)
+{
+    size_t i = pos;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    ScanVector escape = broadcast(escapeByte);
+    while (i + SCAN_WIDTH + MIN_RUN_LENGTH - 1 <= n)
+    {
+        uint32_t mask = specialMask(data + i, escape);
+        if (mask != 0)
+            return i + countTrailingZeros(mask);
+        i += SCAN_WIDTH;
+    }
+#endif
+    while (i < n && data[i] != escapeByte && !isRunStart(data, i, n))
+        i++;
+    return i;
+}
+
+// First position at or after pos starting a run; n if none
+size_t findRunStart(const uint8_t *data, size_t pos, size_t n)
+{
+    size_t i = pos;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+    while (i + SCAN_WIDTH + MIN_RUN_LENGTH - 1 <= n)
+    {
+        uint32_t mask = runMask(data + i);
+        if (mask != 0)
+            return i + countTrailingZeros(mask);
+        i += SCAN_WIDTH;
+    }
+#endif
+    while (i < n && !isRunStart(data, i, n))
+        i++;
+    return i;
+}
+
+// Append value as a LEB128 varint (7 bits per byte, high bit = more follow)
+void appendVarint(vector<uint8_t> &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+// Parse a LEB128 varint at pos; false if truncated or wider than 64 bits
+bool readVarint(const uint8_t *data, size_t n, size_t &pos, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < n; shift += 7)
+    {
+        uint8_t b = data[pos++];
+        value |= static_cast<uint64_t>(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Add the byte histogram of the data to counts
+void countBytes(const uint8_t *data, size_t n, uint64_t counts[256])
+{
+    // Four interleaved tables avoid stalls on repeated increments of the same counter
+    uint64_t partial[4][256] = {};
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        partial[0][data[i]]++;
+        partial[1][data[i + 1]]++;
+        partial[2][data[i + 2]]++;
+        partial[3][data[i + 3]]++;
+    }
+    for (; i < n; i++)
+        partial[0][data[i]]++;
+
+    for (int b = 0; b < 256; b++)
+        counts[b] += partial[0][b] + partial[1][b] + partial[2][b] + partial[3][b];
+}
+
+// Least frequent byte value of a histogram (highest value on ties, so 0xFF stays the default)
+uint8_t leastFrequentByte(const uint64_t counts[256])
+{
+    int best = 255;
+    for (int b = 254; b >= 0; b--)
+    {
+        if (counts[b] < counts[best])
+            best = b;
+    }
+    return static_cast<uint8_t>(best);
+}
+
+// Least frequent byte value of the data
+uint8_t chooseEscapeByte(const uint8_t *data, size_t n)
+{
+    uint64_t counts[256] = {};
+    countBytes(data, n, counts);
+    return leastFrequentByte(counts);
+}
+
+// Encoder state carried between chunks: the output format and escape byte,
+// and a run that reached the end of the previous chunk and may continue into
+// the next one
+struct EncoderState
+{
+    uint8_t format = FORMAT_ADAPTIVE_ESCAPE;
+    uint8_t escape = ESCAPE_BYTE;
+    uint8_t runByte = 0;
+    uint64_t runLength = 0;
+};
+
+// Append the stream header: magic, version and (version 3) the escape byte
+void appendHeader(vector<uint8_t> &out, const EncoderState &state)
+{
+    out.insert(out.end(), FORMAT_MAGIC, FORMAT_MAGIC + sizeof(FORMAT_MAGIC));
+    out.push_back(state.format);
+    if (state.format == FORMAT_ADAPTIVE_ESCAPE)
+        out.push_back(state.escape);
+}
+
+// Append a run token: escape + count + byte, or a version 5 repeat header + byte
+inline void appendRun(vector<uint8_t> &out, const EncoderState &state, uint64_t length, uint8_t byte)
+{
+    if (state.format == FORMAT_PACKBITS)
+    {
+        appendVarint(out, (length - MIN_RUN_LENGTH) << 1 | 1);
+    }
+    else
+    {
+        out.push_back(state.escape);
+        appendVarint(out, length);
+    }
+    out.push_back(byte);
+}
+
+// Append literal bytes that contain no escape byte; version 5 literal runs get
+// a header each and are split at MAX_LITERAL_RUN
+inline void appendLiterals(vector<uint8_t> &out, const EncoderState &state, const uint8_t *data, size_t length)
+{
+    if (state.format != FORMAT_PACKBITS)
+    {
+        out.insert(out.end(), data, data + length);
+        return;
+    }
+    while (length > 0)
+    {
+        size_t take = min(length, MAX_LITERAL_RUN);
+        appendVarint(out, static_cast<uint64_t>(take - 1) << 1);
+        out.insert(out.end(), data, data + take);
+        data += take;
+        length -= take;
+    }
+}
+
+// Encode data[0, n) into out and return how many bytes were consumed. Unless
+// final, up to MIN_RUN_LENGTH - 1 trailing bytes are left unconsumed, since they
+// may start a run together with the next chunk; the caller passes them again at
+// the front of the next call. A run reaching the end of the chunk is held in
+// the state. Any split of the input produces the same tokens as a single call.
+size_t encodeChunk(EncoderState &state, const uint8_t *data, size_t n, bool final, vector<uint8_t> &out)
+{
     size_t i = 0;
+    if (state.runLength > 0)
+    {
+        i = countRun(data, 0, n, state.runByte);
+        state.runLength += i;
+        if (i == n && !final)
+            return n;
+        appendRun(out, state, state.runLength, state.runByte);
+        state.runLength = 0;
+    }
 
-    while (i < input.size())
+    size_t keep = final ? n : n - min(n, static_cast<size_t>(MIN_RUN_LENGTH - 1));
+    while (i < keep)
     {
-        uint8_t currentByte = input[i];
-        size_t runLength = 1;
+        // Version 5 has no escape byte, so only runs are special
+        size_t special = state.format == FORMAT_PACKBITS ? findRunStart(data, i, n)
+                                                         : findSpecial(data, i, n, state.escape);
 
-        // Count consecutive identical bytes
-        while (i + runLength < input.size() &&
-               input[i + runLength] == currentByte &&
-               runLength < 255)
+        if (special < n && isRunStart(data, special, n))
         {
-            runLength++;
-        }
+            // The run may begin up to three bytes earlier, inside what looked like literals
+            size_t start = special;
+            while (start > i && data[start - 1] == data[special])
+                start--;
+            appendLiterals(out, state, data + i, start - i);
 
-        if (runLength >= MIN_RUN_LENGTH)
+            size_t runLength = countRun(data, start, n, data[start]);
+            i = start + runLength;
+            if (i == n && !final)
+            {
+                state.runByte = data[start];
+                state.runLength = runLength;
+                return n;
+            }
+            appendRun(out, state, runLength, data[start]);
+        }
+        else if (special >= keep)
         {
-            // Encode as: ESCAPE_BYTE + count + byte
-            compressed.push_back(ESCAPE_BYTE);
-            compressed.push_back(static_cast<uint8_t>(runLength));
-            compressed.push_back(currentByte);
-            i += runLength;
+            // Output literal bytes in bulk, holding back the undecided tail
+            appendLiterals(out, state, data + i, keep - i);
+            i = keep;
         }
         else
         {
-            // Output literal bytes
-            for (size_t j = 0; j < runLength; j++)
-            {
-                if (currentByte == ESCAPE_BYTE)
-                {
-                    // Escape the escape byte: 0xFF -> 0xFF 0x00
-                    compressed.push_back(ESCAPE_BYTE);
-                    compressed.push_back(0x00);
-                }
-                else
-                {
-                    compressed.push_back(currentByte);
-                }
-            }
-            i += runLength;
+            appendLiterals(out, state, data + i, special - i);
+            // Escape the escape byte: escape -> escape 0x00
+            out.push_back(state.escape);
+            out.push_back(0x00);
+            i = special + 1;
         }
     }
+    return i;
+}
 
+// Binary-safe RLE Compression into format version 3 or 5
+vector<uint8_t> rleCompressBinary(const vector<uint8_t> &input, uint8_t format = DEFAULT_FORMAT)
+{
+    if (input.empty())
+        return {};
+
+    EncoderState state;
+    state.format = format;
+    if (format == FORMAT_ADAPTIVE_ESCAPE)
+        state.escape = chooseEscapeByte(input.data(), input.size());
+
+    vector<uint8_t> compressed;
+    compressed.reserve(input.size() / 2 + 16);
+    appendHeader(compressed, state);
+    encodeChunk(state, input.data(), input.size(), true, compressed);
     return compressed;
 }
 
+// Stream version and escape byte, and where the token stream begins
+struct StreamHeader
+{
+    uint8_t version = FORMAT_LEGACY;
+    uint8_t escape = ESCAPE_BYTE;
+    size_t bodyStart = 0;
+};
+
+// Parse the stream header; headerless data is version 1. False if unsupported or truncated
+bool parseHeader(const uint8_t *data, size_t n, StreamHeader &header)
+{
+    header = StreamHeader();
+    if (n <= sizeof(FORMAT_MAGIC) || !equal(FORMAT_MAGIC, FORMAT_MAGIC + sizeof(FORMAT_MAGIC), data))
+        return true;
+
+    header.version = data[sizeof(FORMAT_MAGIC)];
+    header.bodyStart = sizeof(FORMAT_MAGIC) + 1;
+    if (header.version == FORMAT_VARINT || header.version == FORMAT_PACKBITS || header.version == FORMAT_STORED)
+        return true;
+    if (header.version == FORMAT_ADAPTIVE_ESCAPE && header.bodyStart < n)
+    {
+        header.escape = data[header.bodyStart++];
+        return true;
+    }
+    cerr << "Error: Unsupported or truncated format header" << endl;
+    return false;
+}
+
+// Longest token: a version 5 literal run with its 3-byte header (escape
+// tokens of versions 1-3 are at most 12 bytes)
+const size_t MAX_TOKEN_SIZE = 3 + MAX_LITERAL_RUN;
+
+// Walk version 5 tokens from pos; see walkTokens
+template <typename Literal, typename Run>
+bool walkPackBits(const uint8_t *data, size_t n, size_t &pos, Literal literal, Run run)
+{
+    while (pos < n)
+    {
+        size_t i = pos;
+        uint64_t h;
+        if (!readVarint(data, n, i, h))
+            return false;
+        if (h & 1)
+        {
+            if (i >= n || (h >> 1) > UINT64_MAX - MIN_RUN_LENGTH)
+                return false;
+            run(data[i], (h >> 1) + MIN_RUN_LENGTH);
+            pos = i + 1;
+        }
+        else
+        {
+            uint64_t length = (h >> 1) + 1;
+            if (length > MAX_LITERAL_RUN || length > n - i)
+                return false;
+            literal(data + i, static_cast<size_t>(length));
+            pos = i + static_cast<size_t>(length);
+        }
+    }
+    return true;
+}
+
+// Walk the token stream from pos, calling literal(ptr, length) for each literal
+// span and run(byte, count) for each run. Literal spans are found with memchr,
+// so only escape bytes are inspected individually. Returns false if the data
+// ends inside a token (or the token is malformed), leaving pos at its start.
+// A stored stream is one literal span.
+template <typename Literal, typename Run>
+bool walkTokens(const uint8_t *data, size_t n, size_t &pos, const StreamHeader &header, Literal literal, Run run)
+{
+    if (header.version == FORMAT_PACKBITS)
+        return walkPackBits(data, n, pos, literal, run);
+    if (header.version == FORMAT_STORED)
+    {
+        if (pos < n)
+            literal(data + pos, n - pos);
+        pos = n;
+        return true;
+    }
+
+    while (pos < n)
+    {
+        const uint8_t *found = static_cast<const uint8_t *>(memchr(data + pos, header.escape, n - pos));
+        size_t next = found ? static_cast<size_t>(found - data) : n;
+        if (next > pos)
+            literal(data + pos, next - pos);
+        pos = next;
+        if (!found)
+            break;
+
+        size_t i = next + 1;
+        if (i >= n)
+            return false;
+
+        if (data[i] == 0x00)
+        {
+            // Escaped escape byte: escape 0x00 -> escape
+            literal(data + next, 1);
+            pos = i + 1;
+            continue;
+        }
+
+        // Run-length encoded: escape + count + byte
+        uint64_t count;
+        if (header.version == FORMAT_LEGACY)
+            count = data[i++];
+        else if (!readVarint(data, n, i, count))
+            return false;
+        if (i >= n)
+            return false;
+        run(data[i], count);
+        pos = i + 1;
+    }
+    return true;
+}
+
 // Binary-safe RLE Decompression
+// A sizing pass computes the exact output length so the output is allocated
+// once; literal spans are then appended as block copies and runs as fills.
 vector<uint8_t> rleDecompressBinary(const vector<uint8_t> &compressed)
 {
     if (compressed.empty())
         return {};
 
+    const uint8_t *data = compressed.data();
+    size_t n = compressed.size();
+    StreamHeader header;
+    if (!parseHeader(data, n, header))
+        return {};
+
+    uint64_t total = 0;
+    size_t pos = header.bodyStart;
+    bool valid = walkTokens(
+        data, n, pos, header,
+        [&](const uint8_t *, size_t length)
+        { total += length; },
+        [&](uint8_t, uint64_t count)
+        { total = count > UINT64_MAX - total ? UINT64_MAX : total + count; });
+    if (total > vector<uint8_t>().max_size())
+    {
+        cerr << "Error: Decompressed size is too large" << endl;
+        return {};
+    }
+
+    // reserve + insert avoids zero-filling the buffer before overwriting it.
+    // Run counts are unchecked input, so a crafted stream can claim more than
+    // fits in memory
     vector<uint8_t> decompressed;
-    size_t i = 0;
+    try
+    {
+        decompressed.reserve(total);
+        pos = header.bodyStart;
+        walkTokens(
+            data, n, pos, header,
+            [&](const uint8_t *src, size_t length)
+            { decompressed.insert(decompressed.end(), src, src + length); },
+            [&](uint8_t byte, uint64_t count)
+            { decompressed.insert(decompressed.end(), count, byte); });
+    }
+    catch (const bad_alloc &)
+    {
+        cerr << "Error: Corrupt input: decompressed size does not fit in memory" << endl;
+        return {};
+    }
+
+    if (!valid)
+        cerr << "Error: Unexpected end of compressed data" << endl;
+    return decompressed;
+}
 
-    while (i < compressed.size())
+/*
+ * Streaming
+ *
+ * Files are processed in STREAM_CHUNK_SIZE pieces so memory stays bounded no
+ * matter how large the input is. The encoder carries a pending run and up to
+ * three undecided bytes from one chunk to the next; the decoder carries an
+ * incomplete token (at most MAX_TOKEN_SIZE bytes) and writes long runs out a
+ * chunk at a time. Both produce exactly the bytes of the in-memory functions.
+ */
+const size_t STREAM_CHUNK_SIZE = 1 << 22; // 4 MiB
+
+// Zero runs at least this long are written as holes when sparse output is on
+const uint64_t SPARSE_MIN_HOLE = 1 << 15; // 32 KiB
+
+// Buffers output and writes it in chunk-sized pieces, so a run of any length
+// needs at most one chunk of memory. With sparse set, long zero runs are
+// skipped with a seek instead of written; on a new or pre-sized file they
+// stay holes (the caller must set the final file size if it ends in one)
+struct ChunkWriter
+{
+    ostream &out;
+    size_t limit;
+    bool sparse;
+    vector<uint8_t> buffer;
+    uint64_t written = 0;
+
+    ChunkWriter(ostream &out, size_t chunkSize, bool sparse = false) : out(out), limit(chunkSize), sparse(sparse)
+    {
+        buffer.reserve(chunkSize);
+    }
+
+    void append(const uint8_t *data, size_t length)
     {
-        if (compressed[i] == ESCAPE_BYTE)
+        if (buffer.size() + length > limit)
+            flush();
+        if (length >= limit)
         {
-            if (i + 1 >= compressed.size())
-            {
-                cerr << "Error: Unexpected end of compressed data" << endl;
+            out.write(reinterpret_cast<const char *>(data), length);
+            written += length;
+        }
+        else
+            buffer.insert(buffer.end(), data, data + length);
+    }
+
+    void fill(uint8_t byte, uint64_t count)
+    {
+        if (sparse && byte == 0 && count >= SPARSE_MIN_HOLE)
+        {
+            flush();
+            out.seekp(static_cast<streamoff>(count), ios::cur);
+            written += count;
+            return;
+        }
+        while (count > 0)
+        {
+            if (buffer.size() == limit)
+                flush();
+            size_t take = static_cast<size_t>(min<uint64_t>(count, limit - buffer.size()));
+            buffer.insert(buffer.end(), take, byte);
+            count -= take;
+        }
+    }
+
+    bool flush()
+    {
+        out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+        written += buffer.size();
+        buffer.clear();
+        return out.good();
+    }
+};
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+// Read-only file buffer for sparse files. SEEK_DATA/SEEK_HOLE locate the holes,
+// which are produced as zeros from memory instead of being read from disk.
+// Read errors are thrown, which istream turns into badbit
+class SparseFileBuf : public streambuf
+{
+public:
+    ~SparseFileBuf()
+    {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    bool open(const string &path)
+    {
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+            return false;
+        size = static_cast<uint64_t>(st.st_size);
+        return true;
+    }
+
+    // Length of the hole at the read position; 0 inside data
+    uint64_t holeAhead()
+    {
+        if (gptr() != egptr() || pos >= size)
+            return 0;
+        if (pos >= extentEnd)
+            locate();
+        return inHole ? extentEnd - pos : 0;
+    }
+
+protected:
+    streamsize xsgetn(char *s, streamsize n) override
+    {
+        streamsize done = min<streamsize>(n, egptr() - gptr());
+        memcpy(s, gptr(), static_cast<size_t>(done));
+        gbump(static_cast<int>(done));
+        while (done < n)
+        {
+            size_t got = fill(s + done, static_cast<size_t>(n - done));
+            if (got == 0)
                 break;
-            }
+            done += static_cast<streamsize>(got);
+        }
+        return done;
+    }
+
+    int_type underflow() override
+    {
+        size_t got = fill(buffer, sizeof(buffer));
+        if (got == 0)
+            return traits_type::eof();
+        setg(buffer, buffer, buffer + got);
+        return traits_type::to_int_type(buffer[0]);
+    }
+
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode) override
+    {
+        uint64_t current = pos - static_cast<uint64_t>(egptr() - gptr());
+        off_type base = dir == ios_base::beg ? 0 : static_cast<off_type>(dir == ios_base::cur ? current : size);
+        if (base + off < 0 || static_cast<uint64_t>(base + off) > size)
+            return pos_type(off_type(-1));
+        pos = static_cast<uint64_t>(base + off);
+        extentEnd = 0;
+        setg(buffer, buffer, buffer);
+        return pos_type(static_cast<off_type>(pos));
+    }
+
+    pos_type seekpos(pos_type target, ios_base::openmode which) override
+    {
+        return seekoff(off_type(target), ios_base::beg, which);
+    }
+
+private:
+    // Copy up to n bytes from pos into dst, zero-filling holes
+    size_t fill(char *dst, size_t n)
+    {
+        if (pos >= size)
+            return 0;
+        if (pos >= extentEnd)
+            locate();
+
+        size_t take = static_cast<size_t>(min<uint64_t>(n, extentEnd - pos));
+        if (inHole)
+            memset(dst, 0, take);
+        else
+        {
+            ssize_t got = pread(fd, dst, take, static_cast<off_t>(pos));
+            if (got < 0)
+                throw ios_base::failure("read error");
+            if (got == 0)
+                size = pos; // File shrank while reading
+            take = static_cast<size_t>(got);
+        }
+        pos += take;
+        return take;
+    }
+
+    // Find whether pos lies in data or a hole, and where that extent ends
+    void locate()
+    {
+        off_t data = lseek(fd, static_cast<off_t>(pos), SEEK_DATA);
+        off_t hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (data < 0 && errno == ENXIO)
+        {
+            // Only a hole remains before the end of the file
+            inHole = true;
+            extentEnd = size;
+        }
+        else if (data < 0 || hole < 0)
+        {
+            // No hole support on this file system: treat everything as data
+            inHole = false;
+            extentEnd = size;
+        }
+        else if (static_cast<uint64_t>(data) > pos)
+        {
+            inHole = true;
+            extentEnd = min<uint64_t>(static_cast<uint64_t>(data), size);
+        }
+        else
+        {
+            inHole = false;
+            extentEnd = min<uint64_t>(static_cast<uint64_t>(hole), size);
+        }
+    }
+
+    int fd = -1;
+    uint64_t size = 0;
+    uint64_t pos = 0;
+    uint64_t extentEnd = 0;
+    bool inHole = false;
+    char buffer[1 << 16];
+};
+#endif
+
+// Length of the hole at the read position if in reads a sparse file, else 0.
+// Readers seek past it and account for the zeros without reading them
+uint64_t holeAhead(istream &in)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    SparseFileBuf *file = dynamic_cast<SparseFileBuf *>(in.rdbuf());
+    return file && in ? file->holeAhead() : 0;
+#else
+    (void)in;
+    return 0;
+#endif
+}
+
+// Byte histogram and length of a whole stream, read in chunks; rewinds the stream
+bool countStreamBytes(istream &in, uint64_t counts[256], uint64_t &size, size_t chunkSize = STREAM_CHUNK_SIZE)
+{
+    vector<uint8_t> buffer(chunkSize);
+    size = 0;
+    while (in)
+    {
+        uint64_t hole = holeAhead(in);
+        if (hole > 0)
+        {
+            counts[0] += hole;
+            size += hole;
+            in.seekg(static_cast<streamoff>(hole), ios::cur);
+            continue;
+        }
+        in.read(reinterpret_cast<char *>(buffer.data()), chunkSize);
+        size_t got = static_cast<size_t>(in.gcount());
+        countBytes(buffer.data(), got, counts);
+        size += got;
+    }
+    if (in.bad())
+    {
+        cerr << "Error: Failed to read input" << endl;
+        return false;
+    }
+    in.clear();
+    in.seekg(0, ios::beg);
+    return true;
+}
+
+// Compress a stream chunk by chunk into format version 3 or 5. Version 3 uses
+// the given escape byte (normally the least frequent byte of the input, see
+// countStreamBytes). inSize and written receive the byte counts
+bool rleCompressStream(istream &in, ostream &out, uint8_t format, uint8_t escape, uint64_t &inSize,
+                       uint64_t &written, size_t chunkSize = STREAM_CHUNK_SIZE)
+{
+    EncoderState state;
+    state.format = format;
+    state.escape = escape;
 
-            uint8_t count = compressed[i + 1];
+    vector<uint8_t> buffer(chunkSize + MIN_RUN_LENGTH - 1);
+    vector<uint8_t> encoded;
+    appendHeader(encoded, state);
+    inSize = 0;
+    written = 0;
 
-            if (count == 0x00)
+    size_t carry = 0;
+    bool final = false;
+    for (uint64_t chunk = 0; !final; chunk++)
+    {
+        size_t n;
+        uint64_t hole = holeAhead(in);
+        if (hole >= MIN_RUN_LENGTH)
+        {
+            // Encode a hole without reading it: a few zeros always end the
+            // chunk in a pending zero run, and the rest of the hole extends it
+            memset(buffer.data() + carry, 0, MIN_RUN_LENGTH);
+            n = carry + MIN_RUN_LENGTH;
+            in.seekg(static_cast<streamoff>(hole), ios::cur);
+            inSize += hole;
+        }
+        else
+        {
+            TraceSpan span("read", chunk);
+            in.read(reinterpret_cast<char *>(buffer.data() + carry), chunkSize);
+            n = carry + static_cast<size_t>(in.gcount());
+            inSize += static_cast<uint64_t>(in.gcount());
+            final = !in;
+            if (in.bad())
             {
-                // Escaped escape byte: 0xFF 0x00 -> 0xFF
-                decompressed.push_back(ESCAPE_BYTE);
-                i += 2;
+                cerr << "Error: Failed to read input" << endl;
+                return false;
             }
-            else
+        }
+
+        size_t used;
+        {
+            TraceSpan span("encode", chunk);
+            used = encodeChunk(state, buffer.data(), n, final, encoded);
+        }
+        if (hole >= MIN_RUN_LENGTH)
+            state.runLength += hole - MIN_RUN_LENGTH;
+        {
+            TraceSpan span("write", chunk);
+            out.write(reinterpret_cast<const char *>(encoded.data()), encoded.size());
+        }
+        if (!out)
+        {
+            cerr << "Error: Failed to write output" << endl;
+            return false;
+        }
+        written += encoded.size();
+        encoded.clear();
+
+        carry = n - used;
+        memmove(buffer.data(), buffer.data() + used, carry);
+    }
+    return true;
+}
+
+// Decompress a stream chunk by chunk. written receives the decompressed size.
+// With sparse set, long zero runs become holes (see ChunkWriter)
+bool rleDecompressStream(istream &in, ostream &out, uint64_t &written, bool sparse = false,
+                         size_t chunkSize = STREAM_CHUNK_SIZE)
+{
+    vector<uint8_t> buffer(chunkSize + MAX_TOKEN_SIZE);
+    ChunkWriter writer(out, chunkSize, sparse);
+    StreamHeader header;
+    bool haveHeader = false;
+    written = 0;
+
+    size_t carry = 0;
+    bool final = false;
+    for (uint64_t chunk = 0; !final; chunk++)
+    {
+        size_t n;
+        {
+            TraceSpan span("read", chunk);
+            in.read(reinterpret_cast<char *>(buffer.data() + carry), chunkSize);
+            n = carry + static_cast<size_t>(in.gcount());
+        }
+        final = !in;
+        if (in.bad())
+        {
+            cerr << "Error: Failed to read input" << endl;
+            return false;
+        }
+
+        size_t pos = 0;
+        if (!haveHeader)
+        {
+            // Wait until the whole header is buffered
+            if (n < sizeof(FORMAT_MAGIC) + 2 && !final)
             {
-                // Run-length encoded: ESCAPE + count + byte
-                if (i + 2 >= compressed.size())
-                {
-                    cerr << "Error: Unexpected end of compressed data" << endl;
-                    break;
-                }
-                uint8_t byte = compressed[i + 2];
-                for (uint8_t j = 0; j < count; j++)
-                {
-                    decompressed.push_back(byte);
-                }
-                i += 3;
+                carry = n;
+                continue;
             }
+            if (!parseHeader(buffer.data(), n, header))
+                return false;
+            pos = header.bodyStart;
+            haveHeader = true;
         }
-        else
+
+        bool complete;
+        {
+            // Includes writing, which ChunkWriter does as its buffer fills
+            TraceSpan span("decode", chunk);
+            complete = walkTokens(
+                buffer.data(), n, pos, header,
+                [&](const uint8_t *src, size_t length)
+                { writer.append(src, length); },
+                [&](uint8_t byte, uint64_t count)
+                { writer.fill(byte, count); });
+        }
+        if (!complete && (final || n - pos >= MAX_TOKEN_SIZE))
         {
-            // Literal byte
-            decompressed.push_back(compressed[i]);
-            i++;
+            writer.flush();
+            written = writer.written;
+            cerr << "Error: Unexpected end of compressed data" << endl;
+            return false;
         }
+
+        carry = n - pos;
+        memmove(buffer.data(), buffer.data() + pos, carry);
     }
 
-    return decompressed;
+    bool ok = writer.flush();
+    written = writer.written;
+    if (!ok)
+        cerr << "Error: Failed to write output" << endl;
+    return ok;
 }
 
-// Read binary file into vector
-vector<uint8_t> readBinaryFile(const string &filename)
+/*
+ * Compressibility check
+ *
+ * Before compressing a file, ESTIMATE_SAMPLES evenly spaced samples of
+ * ESTIMATE_SAMPLE_SIZE bytes are encoded on their own (a small file is one
+ * sample). If the encoded samples come to more than the store threshold of
+ * their raw size, the file is copied unencoded as a version 6 stream instead,
+ * so incompressible input costs one read and a few header bytes.
+ */
+const size_t ESTIMATE_SAMPLES = 32;
+const size_t ESTIMATE_SAMPLE_SIZE = 1 << 14; // 16 KiB
+const double DEFAULT_STORE_ABOVE = 0.95;     // Store raw above this estimated ratio
+
+// Estimated compressed size / input size of a stream in the given format,
+// from encoding samples of it; rewinds the stream
+double estimateRatio(istream &in, uint8_t format)
 {
-    ifstream file(filename, ios::binary | ios::ate);
-    if (!file)
+    TraceSpan span("estimate", 0);
+    in.seekg(0, ios::end);
+    uint64_t size = static_cast<uint64_t>(in.tellg());
+    uint64_t sampleSize = min<uint64_t>(size, ESTIMATE_SAMPLE_SIZE);
+    uint64_t samples = sampleSize == 0 ? 0 : min<uint64_t>(ESTIMATE_SAMPLES, size / sampleSize);
+
+    vector<uint8_t> sample(sampleSize);
+    vector<uint8_t> encoded;
+    uint64_t sampled = 0;
+    for (uint64_t s = 0; s < samples; s++)
     {
-        cerr << "Error: Cannot open file: " << filename << endl;
-        return {};
+        // The first sample starts the stream and the last one ends it
+        uint64_t offset = samples == 1 ? 0 : (size - sampleSize) / (samples - 1) * s;
+        in.seekg(static_cast<streamoff>(offset), ios::beg);
+        in.read(reinterpret_cast<char *>(sample.data()), sampleSize);
+        size_t got = static_cast<size_t>(in.gcount());
+
+        EncoderState state;
+        state.format = format;
+        if (format == FORMAT_ADAPTIVE_ESCAPE)
+            state.escape = chooseEscapeByte(sample.data(), got);
+        encodeChunk(state, sample.data(), got, true, encoded);
+        sampled += got;
     }
 
-    streamsize size = file.tellg();
-    file.seekg(0, ios::beg);
+    in.clear();
+    in.seekg(0, ios::beg);
+    return sampled == 0 ? 1.0 : static_cast<double>(encoded.size()) / sampled;
+}
+
+// Copy a stream chunk by chunk behind a version 6 header. inSize and written
+// receive the byte counts
+bool storeStream(istream &in, ostream &out, uint64_t &inSize, uint64_t &written,
+                 size_t chunkSize = STREAM_CHUNK_SIZE)
+{
+    vector<uint8_t> buffer(FORMAT_MAGIC, FORMAT_MAGIC + sizeof(FORMAT_MAGIC));
+    buffer.push_back(FORMAT_STORED);
+    out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+    inSize = 0;
+    written = buffer.size();
 
-    vector<uint8_t> buffer(size);
-    if (!file.read(reinterpret_cast<char *>(buffer.data()), size))
+    buffer.resize(chunkSize);
+    while (in)
     {
-        cerr << "Error: Failed to read file: " << filename << endl;
-        return {};
+        in.read(reinterpret_cast<char *>(buffer.data()), chunkSize);
+        size_t got = static_cast<size_t>(in.gcount());
+        if (in.bad())
+        {
+            cerr << "Error: Failed to read input" << endl;
+            return false;
+        }
+        out.write(reinterpret_cast<const char *>(buffer.data()), got);
+        inSize += got;
+        written += got;
+    }
+    if (!out)
+    {
+        cerr << "Error: Failed to write output" << endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Chunked container (version 4)
+ *
+ * [FORMAT_MAGIC][4][u32 chunkSize] then one independently compressed chunk per
+ * chunkSize bytes of input: [CHUNK_RLE][escape][tokens] or
+ * [CHUNK_PACKBITS][tokens]. An index of
+ * (u64 offset, u32 compressed size, u32 raw size) per chunk follows the last
+ * chunk, and the file ends with [u64 index offset][u32 chunk count]. Integers
+ * are little-endian. Chunks share no state, so a worker pool compresses them
+ * concurrently, and the index lets decompression fan out as well, each worker
+ * writing its chunk at a known output offset.
+ */
+const uint8_t FORMAT_CHUNKED = 4;
+const uint8_t CHUNK_RLE = 0;      // Chunk kind: escape byte + version 3 tokens
+const uint8_t CHUNK_PACKBITS = 1; // Chunk kind: version 5 tokens
+const size_t CHUNKED_HEADER_SIZE = sizeof(FORMAT_MAGIC) + 1 + 4;
+const size_t CHUNK_INDEX_ENTRY_SIZE = 16;
+const size_t CHUNKED_TRAILER_SIZE = 12;
+
+// Append value as a little-endian integer of the given width
+void appendLE(vector<uint8_t> &out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+// Load a little-endian integer of the given width
+uint64_t loadLE(const uint8_t *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    return value;
+}
+
+// Compress one chunk on its own in format version 3 (with its own escape byte) or 5
+vector<uint8_t> compressChunk(const vector<uint8_t> &raw, uint8_t format)
+{
+    EncoderState state;
+    state.format = format;
+
+    vector<uint8_t> out;
+    out.reserve(raw.size() / 2 + 16);
+    if (format == FORMAT_PACKBITS)
+    {
+        out.push_back(CHUNK_PACKBITS);
+    }
+    else
+    {
+        state.escape = chooseEscapeByte(raw.data(), raw.size());
+        out.push_back(CHUNK_RLE);
+        out.push_back(state.escape);
+    }
+    encodeChunk(state, raw.data(), raw.size(), true, out);
+    return out;
+}
+
+// Compress a stream into the chunked container using a pool of threads. At
+// most 2 * threads chunks are in flight, so memory stays bounded; finished
+// chunks are written in order. inSize and written receive the byte counts
+bool rleCompressChunked(istream &in, ostream &out, size_t threads, uint8_t format, uint64_t &inSize,
+                        uint64_t &written, size_t chunkSize = STREAM_CHUNK_SIZE)
+{
+    vector<uint8_t> header(FORMAT_MAGIC, FORMAT_MAGIC + sizeof(FORMAT_MAGIC));
+    header.push_back(FORMAT_CHUNKED);
+    appendLE(header, chunkSize, 4);
+    out.write(reinterpret_cast<const char *>(header.data()), header.size());
+
+    ThreadPool pool(threads);
+    deque<pair<future<vector<uint8_t>>, size_t>> inFlight;
+    vector<uint8_t> index;
+    uint64_t offset = header.size();
+    uint64_t chunkCount = 0;
+    inSize = 0;
+
+    // Wait for the oldest chunk, write it and record it in the index
+    auto writeOldest = [&]() -> bool
+    {
+        vector<uint8_t> chunk = inFlight.front().first.get();
+        size_t rawSize = inFlight.front().second;
+        inFlight.pop_front();
+        TraceSpan span("write", chunkCount);
+
+        appendLE(index, offset, 8);
+        appendLE(index, chunk.size(), 4);
+        appendLE(index, rawSize, 4);
+        out.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+        offset += chunk.size();
+        chunkCount++;
+        return out.good();
+    };
+
+    vector<uint8_t> zeroChunk;
+    bool final = false;
+    while (!final)
+    {
+        // Whole chunks inside a hole of a sparse file are zeros and are not read
+        uint64_t hole = holeAhead(in);
+        if (hole >= chunkSize)
+        {
+            if (zeroChunk.empty())
+                zeroChunk = compressChunk(vector<uint8_t>(chunkSize), format);
+            promise<vector<uint8_t>> ready;
+            ready.set_value(zeroChunk);
+            inFlight.emplace_back(ready.get_future(), chunkSize);
+            inSize += chunkSize;
+            in.seekg(static_cast<streamoff>(chunkSize), ios::cur);
+            if (inFlight.size() >= 2 * threads && !writeOldest())
+            {
+                cerr << "Error: Failed to write output" << endl;
+                return false;
+            }
+            continue;
+        }
+
+        vector<uint8_t> raw(chunkSize);
+        uint64_t index = chunkCount + inFlight.size();
+        {
+            TraceSpan span("read", index);
+            in.read(reinterpret_cast<char *>(raw.data()), chunkSize);
+        }
+        size_t got = static_cast<size_t>(in.gcount());
+        final = !in;
+        if (in.bad())
+        {
+            cerr << "Error: Failed to read input" << endl;
+            return false;
+        }
+        if (got == 0)
+            break;
+
+        raw.resize(got);
+        inSize += got;
+        inFlight.emplace_back(pool.submit([raw = move(raw), format, index]
+                                          {
+                                              TraceSpan span("encode", index);
+                                              return compressChunk(raw, format); }),
+                              got);
+        if (inFlight.size() >= 2 * threads && !writeOldest())
+        {
+            cerr << "Error: Failed to write output" << endl;
+            return false;
+        }
+    }
+    while (!inFlight.empty())
+    {
+        if (!writeOldest())
+        {
+            cerr << "Error: Failed to write output" << endl;
+            return false;
+        }
+    }
+
+    appendLE(index, offset, 8);
+    appendLE(index, chunkCount, 4);
+    out.write(reinterpret_cast<const char *>(index.data()), index.size());
+    written = offset + index.size();
+    if (!out)
+    {
+        cerr << "Error: Failed to write output" << endl;
+        return false;
     }
+    return true;
+}
+
+// One chunk of a chunked file, with where its data goes in the output
+struct ChunkEntry
+{
+    uint64_t offset;
+    uint32_t compressedSize;
+    uint32_t rawSize;
+    uint64_t rawOffset;
+};
+
+// Read and validate the chunk index of a chunked file
+bool readChunkIndex(istream &in, vector<ChunkEntry> &chunks)
+{
+    in.seekg(0, ios::end);
+    uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+    if (fileSize < CHUNKED_HEADER_SIZE + CHUNKED_TRAILER_SIZE)
+        return false;
+
+    uint8_t header[CHUNKED_HEADER_SIZE];
+    uint8_t trailer[CHUNKED_TRAILER_SIZE];
+    in.seekg(0, ios::beg);
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    in.seekg(fileSize - sizeof(trailer), ios::beg);
+    in.read(reinterpret_cast<char *>(trailer), sizeof(trailer));
+    if (!in)
+        return false;
+
+    uint64_t chunkSize = loadLE(header + sizeof(FORMAT_MAGIC) + 1, 4);
+    uint64_t indexOffset = loadLE(trailer, 8);
+    uint64_t count = loadLE(trailer + 8, 4);
+    if (indexOffset < CHUNKED_HEADER_SIZE || indexOffset > fileSize ||
+        indexOffset + count * CHUNK_INDEX_ENTRY_SIZE + sizeof(trailer) != fileSize)
+        return false;
 
-    return buffer;
+    vector<uint8_t> index(count * CHUNK_INDEX_ENTRY_SIZE);
+    in.seekg(indexOffset, ios::beg);
+    in.read(reinterpret_cast<char *>(index.data()), index.size());
+    if (!in)
+        return false;
+
+    // Chunks follow each other from the header to the index, and all but the
+    // last hold exactly chunkSize bytes, as rleCompressChunked writes them
+    chunks.clear();
+    uint64_t rawOffset = 0;
+    uint64_t offset = CHUNKED_HEADER_SIZE;
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *p = index.data() + i * CHUNK_INDEX_ENTRY_SIZE;
+        ChunkEntry c;
+        c.offset = loadLE(p, 8);
+        c.compressedSize = static_cast<uint32_t>(loadLE(p + 8, 4));
+        c.rawSize = static_cast<uint32_t>(loadLE(p + 12, 4));
+        c.rawOffset = rawOffset;
+        bool last = i + 1 == count;
+        if (c.offset != offset || c.compressedSize > indexOffset - offset || c.rawSize == 0 ||
+            c.rawSize > chunkSize || (!last && c.rawSize != chunkSize))
+            return false;
+        offset += c.compressedSize;
+        rawOffset += c.rawSize;
+        chunks.push_back(c);
+    }
+    return offset == indexOffset;
 }
 
-// Write vector to binary file
-bool writeBinaryFile(const string &filename, const vector<uint8_t> &data)
+// Decode one chunk into out (a ChunkWriter); it must come to exactly rawSize bytes
+bool decodeChunk(const uint8_t *data, size_t n, uint32_t rawSize, ChunkWriter &out)
 {
-    ofstream file(filename, ios::binary);
-    if (!file)
+    StreamHeader header;
+    size_t pos;
+    if (n >= 1 && data[0] == CHUNK_PACKBITS)
+    {
+        header.version = FORMAT_PACKBITS;
+        pos = 1;
+    }
+    else if (n >= 2 && data[0] == CHUNK_RLE)
+    {
+        header.version = FORMAT_ADAPTIVE_ESCAPE;
+        header.escape = data[1];
+        pos = 2;
+    }
+    else
     {
-        cerr << "Error: Cannot create file: " << filename << endl;
         return false;
     }
 
-    file.write(reinterpret_cast<const char *>(data.data()), data.size());
-    return file.good();
+    uint64_t remaining = rawSize;
+    bool overflow = false;
+    bool complete = walkTokens(
+        data, n, pos, header,
+        [&](const uint8_t *src, size_t length)
+        {
+            overflow = overflow || length > remaining;
+            if (!overflow)
+            {
+                out.append(src, length);
+                remaining -= length;
+            }
+        },
+        [&](uint8_t byte, uint64_t count)
+        {
+            overflow = overflow || count > remaining;
+            if (!overflow)
+            {
+                out.fill(byte, count);
+                remaining -= count;
+            }
+        });
+    return complete && !overflow && remaining == 0;
 }
 
-// Compress a file
-bool compressFile(const string &inputFile, const string &outputFile)
+// Decode one chunk of a chunked file and write it at its offset in the output.
+// The output is created empty and only sized once every chunk has decoded, so
+// long zero runs skipped with a seek are left as holes
+bool extractChunk(const string &inputFile, const string &outputFile, const ChunkEntry &chunk, size_t index)
 {
-    cout << "Reading file: " << inputFile << endl;
+    TraceSpan span("extract", index);
+    ifstream in(inputFile, ios::binary);
+    in.seekg(chunk.offset, ios::beg);
+    vector<uint8_t> data(chunk.compressedSize);
+    in.read(reinterpret_cast<char *>(data.data()), data.size());
+    if (!in)
+        return false;
 
-    vector<uint8_t> input = readBinaryFile(inputFile);
-    if (input.empty())
+    fstream out(outputFile, ios::in | ios::out | ios::binary);
+    out.seekp(chunk.rawOffset, ios::beg);
+    ChunkWriter writer(out, min<size_t>(chunk.rawSize, STREAM_CHUNK_SIZE), true);
+    return decodeChunk(data.data(), data.size(), chunk.rawSize, writer) && writer.flush();
+}
+
+// Decompress a chunked file: chunks are decoded in parallel and written straight
+// to their offsets, no more at once than fit maxMemory bytes (0 for no limit).
+// The output gets its final size only once every chunk decoded, and is removed
+// otherwise. written receives the decompressed size
+bool rleDecompressChunked(const string &inputFile, const string &outputFile, size_t threads, uint64_t &written,
+                          uint64_t maxMemory = 0)
+{
+    ifstream in(inputFile, ios::binary);
+    vector<ChunkEntry> chunks;
+    if (!in || !readChunkIndex(in, chunks))
     {
-        cerr << "Error: Input file is empty or could not be read" << endl;
+        cerr << "Error: Corrupt chunk index" << endl;
         return false;
     }
+    in.close();
+    written = chunks.empty() ? 0 : chunks.back().rawOffset + chunks.back().rawSize;
 
-    cout << "Compressing..." << endl;
-    vector<uint8_t> compressed = rleCompressBinary(input);
+    ofstream create(outputFile, ios::binary | ios::trunc);
+    create.close();
+    if (!create)
+    {
+        cerr << "Error: Cannot create file: " << outputFile << endl;
+        return false;
+    }
 
-    if (!writeBinaryFile(outputFile, compressed))
+    if (maxMemory > 0)
     {
+        // A worker holds the compressed chunk and a write buffer of up to STREAM_CHUNK_SIZE
+        uint64_t perChunk = 1;
+        for (const ChunkEntry &chunk : chunks)
+            perChunk = max<uint64_t>(perChunk, chunk.compressedSize + min<uint64_t>(chunk.rawSize, STREAM_CHUNK_SIZE));
+        threads = static_cast<size_t>(max<uint64_t>(1, min<uint64_t>(threads, maxMemory / perChunk)));
+    }
+
+    ThreadPool pool(threads);
+    vector<future<bool>> results;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        results.push_back(pool.submit([&, i]
+                                      { return extractChunk(inputFile, outputFile, chunks[i], i); }));
+    }
+    bool ok = true;
+    for (auto &r : results)
+        ok = r.get() && ok;
+
+    // Chunks ending in a hole leave the file short of its size
+    error_code ec;
+    if (ok)
+        filesystem::resize_file(outputFile, written, ec);
+    if (!ok || ec)
+    {
+        cerr << "Error: Corrupt chunk or failed write while decompressing" << endl;
+        filesystem::remove(outputFile, ec);
         return false;
     }
+    return true;
+}
+
+/*
+ * Memory budget (--max-memory)
+ *
+ * A chunk being coded is held as input, output and up to twice its size of
+ * escape expansion, CHUNK_MEMORY_FACTOR times in all. Streaming keeps one chunk
+ * in memory and the chunked container two per thread, so a budget is met by
+ * running fewer threads and then by using smaller chunks.
+ */
+const uint64_t CHUNK_MEMORY_FACTOR = 4;
+const size_t MIN_BUDGET_CHUNK_SIZE = 1 << 16; // 64 KiB
 
-    double ratio = (compressed.size() * 100.0) / input.size();
+// Lower threads, then chunkSize, until the chunks in flight fit maxMemory bytes
+// (0 for no limit); false if not even MIN_BUDGET_CHUNK_SIZE fits
+bool fitMemoryBudget(uint64_t maxMemory, size_t &threads, size_t &chunkSize)
+{
+    if (maxMemory == 0)
+        return true;
+    threads = static_cast<size_t>(min<uint64_t>(threads, maxMemory / (2 * CHUNK_MEMORY_FACTOR * chunkSize)));
+    if (threads >= 2)
+        return true;
+    threads = 1;
+    chunkSize = static_cast<size_t>(min<uint64_t>(chunkSize, maxMemory / CHUNK_MEMORY_FACTOR));
+    return chunkSize >= MIN_BUDGET_CHUNK_SIZE;
+}
 
-    cout << "\n=== Compression Complete ===" << endl;
-    cout << "Original size:   " << input.size() << " bytes" << endl;
-    cout << "Compressed size: " << compressed.size() << " bytes" << endl;
-    cout << "Compression ratio: " << ratio << "%" << endl;
+// True if the file starts with the chunked container header
+bool isChunkedFile(istream &in)
+{
+    uint8_t header[sizeof(FORMAT_MAGIC) + 1] = {};
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    bool chunked = in && equal(FORMAT_MAGIC, FORMAT_MAGIC + sizeof(FORMAT_MAGIC), header) &&
+                   header[sizeof(FORMAT_MAGIC)] == FORMAT_CHUNKED;
+    in.clear();
+    in.seekg(0, ios::beg);
+    return chunked;
+}
+
+// Byte counts of a compressFile/decompressFile call
+struct FileResult
+{
+    uint64_t inputSize = 0;
+    uint64_t outputSize = 0;
+    bool stored = false; // Copied unencoded because RLE would not pay off
+};
 
-    if (compressed.size() < input.size())
+// Compress a file into format version 3 or 5; with more than one thread it is
+// written as a chunked container. If the estimated ratio is above storeAbove,
+// the file is stored unencoded instead. Threads and chunk size are lowered to
+// fit maxMemory bytes (0 for no limit). False (with the output removed) on failure
+bool compressFile(const string &inputFile, const string &outputFile, FileResult &result,
+                  size_t threads = max(1u, thread::hardware_concurrency()),
+                  uint8_t format = DEFAULT_FORMAT, double storeAbove = DEFAULT_STORE_ABOVE, uint64_t maxMemory = 0)
+{
+    size_t chunkSize = STREAM_CHUNK_SIZE;
+    if (!fitMemoryBudget(maxMemory, threads, chunkSize))
     {
-        cout << "Space saved: " << (input.size() - compressed.size()) << " bytes" << endl;
+        cerr << "Error: Memory budget too small for: " << inputFile << endl;
+        return false;
     }
-    else
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    // Holes of sparse files are skipped instead of read
+    SparseFileBuf file;
+    istream in(&file);
+    if (!file.open(inputFile))
+#else
+    ifstream in(inputFile, ios::binary);
+    if (!in)
+#endif
     {
-        cout << "Note: File did not compress well (random/already compressed data)" << endl;
+        cerr << "Error: Cannot open file: " << inputFile << endl;
+        return false;
+    }
+
+    if (in.peek() == ifstream::traits_type::eof())
+    {
+        cerr << "Error: Input file is empty or could not be read: " << inputFile << endl;
+        return false;
+    }
+
+    ofstream out(outputFile, ios::binary);
+    if (!out)
+    {
+        cerr << "Error: Cannot create file: " << outputFile << endl;
+        return false;
     }
 
+    bool ok;
+    if (estimateRatio(in, format) > storeAbove)
+    {
+        result.stored = true;
+        ok = storeStream(in, out, result.inputSize, result.outputSize, chunkSize);
+    }
+    else if (threads > 1)
+    {
+        ok = rleCompressChunked(in, out, threads, format, result.inputSize, result.outputSize, chunkSize);
+    }
+    else if (format == FORMAT_PACKBITS)
+    {
+        ok = rleCompressStream(in, out, format, 0, result.inputSize, result.outputSize, chunkSize);
+    }
+    else
+    {
+        // First pass picks the escape byte, second pass encodes
+        uint64_t counts[256] = {};
+        ok = countStreamBytes(in, counts, result.inputSize, chunkSize) &&
+             rleCompressStream(in, out, format, leastFrequentByte(counts), result.inputSize, result.outputSize,
+                               chunkSize);
+    }
+    if (!ok)
+        return discardOutput(out, outputFile);
     return true;
 }
 
-// Decompress a file
-bool decompressFile(const string &inputFile, const string &outputFile)
+// Decompress a file; chunked containers are decoded on the given number of threads.
+// Memory use is kept within maxMemory bytes (0 for no limit). False (with the
+// output removed) on failure
+bool decompressFile(const string &inputFile, const string &outputFile, FileResult &result,
+                    size_t threads = max(1u, thread::hardware_concurrency()), uint64_t maxMemory = 0)
 {
-    cout << "Reading compressed file: " << inputFile << endl;
-
-    vector<uint8_t> compressed = readBinaryFile(inputFile);
-    if (compressed.empty())
+    ifstream in(inputFile, ios::binary | ios::ate);
+    if (!in)
     {
-        cerr << "Error: Compressed file is empty or could not be read" << endl;
+        cerr << "Error: Cannot open file: " << inputFile << endl;
+        return false;
+    }
+    result.inputSize = static_cast<uint64_t>(in.tellg());
+    in.seekg(0, ios::beg);
+    if (result.inputSize == 0)
+    {
+        cerr << "Error: Compressed file is empty or could not be read: " << inputFile << endl;
         return false;
     }
 
-    cout << "Decompressing..." << endl;
-    vector<uint8_t> decompressed = rleDecompressBinary(compressed);
+    if (isChunkedFile(in))
+    {
+        in.close();
+        return rleDecompressChunked(inputFile, outputFile, threads, result.outputSize, maxMemory);
+    }
 
-    if (!writeBinaryFile(outputFile, decompressed))
+    size_t streamThreads = 1, chunkSize = STREAM_CHUNK_SIZE;
+    if (!fitMemoryBudget(maxMemory, streamThreads, chunkSize))
     {
+        cerr << "Error: Memory budget too small for: " << inputFile << endl;
         return false;
     }
 
-    cout << "\n=== Decompression Complete ===" << endl;
-    cout << "Compressed size:   " << compressed.size() << " bytes" << endl;
-    cout << "Decompressed size: " << decompressed.size() << " bytes" << endl;
+    ofstream out(outputFile, ios::binary);
+    if (!out)
+    {
+        cerr << "Error: Cannot create file: " << outputFile << endl;
+        return false;
+    }
+    if (!rleDecompressStream(in, out, result.outputSize, true, chunkSize))
+        return discardOutput(out, outputFile);
 
+    // Give the file its full length in case it ends in a hole
+    out.close();
+    error_code ec;
+    filesystem::resize_file(outputFile, result.outputSize, ec);
     return true;
 }
 
+// Print the outcome of a compression for the interactive menu
+void printCompressionReport(const FileResult &result)
+{
+    double ratio = (result.outputSize * 100.0) / result.inputSize;
+
+    cout << "\n=== Compression Complete ===" << endl;
+    cout << "Original size:   " << result.inputSize << " bytes" << endl;
+    cout << "Compressed size: " << result.outputSize << " bytes" << endl;
+    cout << "Compression ratio: " << ratio << "%" << endl;
+
+    if (result.outputSize < result.inputSize)
+    {
+        cout << "Space saved: " << (result.inputSize - result.outputSize) << " bytes" << endl;
+    }
+    else
+    {
+        cout << "Note: File did not compress well (random/already compressed data)" << endl;
+    }
+    if (result.stored)
+    {
+        cout << "Stored uncompressed: sampling predicted RLE would not save space" << endl;
+    }
+}
+
+// Print the outcome of a decompression for the interactive menu
+void printDecompressionReport(const FileResult &result)
+{
+    cout << "\n=== Decompression Complete ===" << endl;
+    cout << "Compressed size:   " << result.inputSize << " bytes" << endl;
+    cout << "Decompressed size: " << result.outputSize << " bytes" << endl;
+}
+
 // Text string compression (for demo purposes)
 string rleCompressText(const string &input)
 {
@@ -243,7 +1623,84 @@ string rleDecompressText(const string &compressed)
     return string(decompressed.begin(), decompressed.end());
 }
 
-int main()
+/*
+ * Batch mode
+ *
+ * "c" and "d" take any number of files and process up to -j of them at once.
+ * Each file gets one status line on stdout; the exit code is 0 if every file
+ * succeeded, 1 if any failed and 2 on a usage error.
+ */
+const string COMPRESSED_SUFFIX = ".rle";
+
+// Output name for a batch input: add the suffix, or strip it when decompressing
+string batchOutputName(const string &input, bool compress)
+{
+    if (compress)
+        return input + COMPRESSED_SUFFIX;
+    size_t n = COMPRESSED_SUFFIX.size();
+    if (input.size() > n && input.compare(input.size() - n, n, COMPRESSED_SUFFIX) == 0)
+        return input.substr(0, input.size() - n);
+    return input + ".out";
+}
+
+// Compress or decompress every file, jobs at a time; returns the number of failures.
+// Spare threads go to the files themselves (chunked container) when there are few files.
+// With a memory budget, fewer files run at once if each could not stream a full chunk
+size_t runBatch(const vector<string> &files, const string &output, bool compress, size_t jobs, uint8_t format,
+                double storeAbove, uint64_t maxMemory = 0)
+{
+    size_t workers = min(jobs, files.size());
+    if (maxMemory > 0)
+        workers = static_cast<size_t>(
+            max<uint64_t>(1, min<uint64_t>(workers, maxMemory / (CHUNK_MEMORY_FACTOR * STREAM_CHUNK_SIZE))));
+    size_t threadsPerFile = max<size_t>(1, jobs / workers);
+    uint64_t memoryPerFile = maxMemory / workers;
+    ThreadPool pool(workers);
+    mutex printLock;
+    vector<future<bool>> results;
+    for (const string &file : files)
+    {
+        results.push_back(pool.submit([&, file]
+                                      {
+            string target = output.empty() ? batchOutputName(file, compress) : output;
+            FileResult result;
+            bool ok = compress ? compressFile(file, target, result, threadsPerFile, format, storeAbove, memoryPerFile)
+                               : decompressFile(file, target, result, threadsPerFile, memoryPerFile);
+            lock_guard<mutex> lock(printLock);
+            if (ok)
+                cout << "ok      " << file << " -> " << target << " (" << result.inputSize << " -> "
+                     << result.outputSize << " bytes" << (result.stored ? ", stored" : "") << ")" << endl;
+            else
+                cout << "FAILED  " << file << endl;
+            return ok; }));
+    }
+    size_t failures = 0;
+    for (auto &r : results)
+        failures += r.get() ? 0 : 1;
+    return failures;
+}
+
+void printUsage(const char *prog)
+{
+    cerr << "Usage: " << prog << " [options] c <file>...\n"
+         << "   or: " << prog << " [options] d <file>...\n"
+         << "   or: " << prog << "   (no arguments: interactive menu)\n"
+         << "Options:\n"
+         << "  -j <n>          files processed at once (default: all cores)\n"
+         << "  -o <file>       output name, for a single input file\n"
+         << "  --format <3|5>  escape-byte (3) or PackBits-style (5) stream, default 5\n"
+         << "  --trace <file>  write a Chrome/Perfetto trace of the chunk work\n"
+         << "  --store-above <pct>\n"
+         << "                  store files raw if RLE is estimated above pct% of their size\n"
+         << "                  (default " << DEFAULT_STORE_ABOVE * 100 << ")\n"
+         << "  --max-memory <n>\n"
+         << "                  memory budget in bytes, k/m/g suffix allowed; lowers threads and\n"
+         << "                  chunk size to fit, and reports the peak at the end\n"
+         << "Mode c writes <file>" << COMPRESSED_SUFFIX << ", mode d strips the suffix (or adds .out).\n";
+}
+
+// Interactive menu
+int runMenu()
 {
     int choice;
     string input, output;
@@ -261,7 +1718,8 @@ int main()
     while (true)
     {
         cout << "\nEnter choice (1-5): ";
-        cin >> choice;
+        if (!(cin >> choice))
+            return 0;
         cin.ignore();
 
         switch (choice)
@@ -272,7 +1730,10 @@ int main()
             getline(cin, input);
             cout << "Enter output file path: ";
             getline(cin, output);
-            compressFile(input, output);
+            cout << "Compressing " << input << "..." << endl;
+            FileResult result;
+            if (compressFile(input, output, result))
+                printCompressionReport(result);
             break;
         }
         case 2:
@@ -281,7 +1742,10 @@ int main()
             getline(cin, input);
             cout << "Enter output file path: ";
             getline(cin, output);
-            decompressFile(input, output);
+            cout << "Decompressing " << input << "..." << endl;
+            FileResult result;
+            if (decompressFile(input, output, result))
+                printDecompressionReport(result);
             break;
         }
         case 3:
@@ -313,3 +1777,97 @@ int main()
 
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    if (argc == 1)
+        return runMenu();
+
+    size_t jobs = max(1u, thread::hardware_concurrency());
+    uint8_t format = DEFAULT_FORMAT;
+    double storeAbove = DEFAULT_STORE_ABOVE;
+    uint64_t maxMemory = 0;
+    string output, traceFile;
+    vector<string> args;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "-j" && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1)
+            {
+                cerr << "Invalid thread count: " << argv[i] << endl;
+                return 2;
+            }
+            jobs = static_cast<size_t>(n);
+        }
+        else if (arg == "-o" && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            string value = argv[++i];
+            if (value != "3" && value != "5")
+            {
+                cerr << "Invalid format: " << value << endl;
+                return 2;
+            }
+            format = value == "3" ? FORMAT_ADAPTIVE_ESCAPE : FORMAT_PACKBITS;
+        }
+        else if (arg == "--trace" && i + 1 < argc)
+        {
+            traceFile = argv[++i];
+        }
+        else if (arg == "--store-above" && i + 1 < argc)
+        {
+            double pct = atof(argv[++i]);
+            if (pct <= 0)
+            {
+                cerr << "Invalid store threshold: " << argv[i] << endl;
+                return 2;
+            }
+            storeAbove = pct / 100;
+        }
+        else if (arg == "--max-memory" && i + 1 < argc)
+        {
+            maxMemory = parseSize(argv[++i]);
+            if (maxMemory == 0)
+            {
+                cerr << "Invalid memory budget: " << argv[i] << endl;
+                return 2;
+            }
+        }
+        else
+        {
+            args.push_back(arg);
+        }
+    }
+
+    if (args.size() < 2 || (args[0] != "c" && args[0] != "d") || (!output.empty() && args.size() != 2))
+    {
+        printUsage(argv[0]);
+        return 2;
+    }
+
+    Trace trace;
+    if (!traceFile.empty())
+        activeTrace = &trace;
+
+    vector<string> files(args.begin() + 1, args.end());
+    size_t failures = runBatch(files, output, args[0] == "c", jobs, format, storeAbove, maxMemory);
+    if (maxMemory > 0)
+    {
+        uint64_t peak = peakMemory();
+        cerr << "Peak memory: " << peak << " bytes (budget " << maxMemory << " bytes)" << endl;
+        if (peak > maxMemory)
+            cerr << "Warning: peak memory exceeded the budget" << endl;
+    }
+    if (activeTrace && !trace.write(traceFile))
+    {
+        cerr << "Error writing trace: " << traceFile << endl;
+        return 1;
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "corpus.h"
+using namespace std;
+namespace fs = std::filesystem;
+
+/*
+ * Round-trip tests
+ *
+ * Drives the built tools (rle, rle_binary, project and gen_corpus, see
+ * run_tests.sh) and checks that:
+ *
+ *   - every corpus.h profile decodes back to its input through each tool and
+ *     mode, archives included, and sparse files keep their holes
+ *   - the files in testdata/baseline, written by the original versions of the
+ *     tools, still decode
+ *   - truncated or corrupted files make the decoder exit non-zero and leave
+ *     no output file
+ *
+ * Text RLE, escape-byte streams (version 3) and stored files carry no sizes,
+ * so a cut that falls between tokens leaves a valid shorter file; the
+ * truncation checks cut where the format can tell.
+ */
+
+const size_t PROFILE_SIZE = 256 << 10;
+const size_t LARGE_SIZE = 9 << 20; // Over two chunks of the rle_binary container
+const uint64_t SEED = 1;
+const uint64_t HOLE_SLACK = 64 << 10; // Allocation a decoded sparse file may have beyond its input
+
+string binDir, workDir;
+int checks = 0, failures = 0;
+
+void check(bool ok, const string &what)
+{
+    checks++;
+    if (!ok)
+    {
+        failures++;
+        cout << "FAIL " << what << endl;
+    }
+}
+
+// Run a tool from binDir with its output discarded; its exit status, or -1 if
+// it was killed by a signal (a crash is never a correct answer). The shell
+// reports a killed command as status 128 + signal
+int exitStatus(const string &tool, const string &args)
+{
+    string command = "\"" + binDir + "/" + tool + "\" " + args + " >/dev/null 2>&1";
+    int status = system(command.c_str());
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) > 128)
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+bool run(const string &tool, const string &args)
+{
+    return exitStatus(tool, args) == 0;
+}
+
+// True if the tool reported an error and exited
+bool rejects(const string &tool, const string &args)
+{
+    return exitStatus(tool, args) > 0;
+}
+
+// A path as one shell word
+string shellQuoted(const string &path)
+{
+    return "\"" + path + "\"";
+}
+
+string work(const string &name)
+{
+    return workDir + "/" + name;
+}
+
+vector<unsigned char> readBytes(const string &path)
+{
+    ifstream in(path, ios::binary);
+    return vector<unsigned char>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+bool writeBytes(const string &path, const vector<unsigned char> &data)
+{
+    ofstream out(path, ios::binary);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    return out.good();
+}
+
+bool sameBytes(const string &a, const string &b)
+{
+    return fs::exists(a) && fs::exists(b) && readBytes(a) == readBytes(b);
+}
+
+// Bytes of disk a file takes up, which holes do not count towards
+uint64_t allocatedBytes(const string &path)
+{
+    struct stat info = {};
+    return stat(path.c_str(), &info) == 0 ? static_cast<uint64_t>(info.st_blocks) * 512 : 0;
+}
+
+/* Round trips */
+
+// Compress input with a tool and its options, decompress it again and compare
+void roundTrip(const string &tool, const string &options, const string &input, const string &label,
+               const string &decodeOptions = "")
+{
+    string packed = work("packed"), output = work("output");
+    fs::remove(packed);
+    fs::remove(output);
+    bool ok;
+    if (tool == "project")
+        ok = run(tool, options + " c " + shellQuoted(input) + " " + shellQuoted(packed)) &&
+             run(tool, decodeOptions + " d " + shellQuoted(packed) + " " + shellQuoted(output));
+    else
+        ok = run(tool, options + " -o " + shellQuoted(packed) + " c " + shellQuoted(input)) &&
+             run(tool, decodeOptions + " -o " + shellQuoted(output) + " d " + shellQuoted(packed));
+    check(ok && sameBytes(input, output), tool + " " + options + " on " + label);
+}
+
+void testProfiles(const vector<string> &inputs, const string &dictionary)
+{
+    const vector<string> rleModes = {"", "--store-above 1000", "--max-memory 256k"};
+    const vector<string> binaryModes = {"-j 1 --format 3", "-j 1 --format 5", "-j 4 --format 3", "-j 4 --format 5",
+                                        "-j 1 --store-above 1", "-j 1 --max-memory 512k"};
+    const vector<string> huffmanModes = {"",     "--bwt",           "--rle", "--bwt --rle", "--no-static-tables",
+                                         "-j 1", "--block-size 64k", "--bwt --block-size 64k"};
+    string dictOption = "--dict " + shellQuoted(dictionary);
+    for (const string &input : inputs)
+    {
+        string label = fs::path(input).filename().string();
+        for (const string &mode : rleModes)
+            roundTrip("rle", mode, input, label);
+        for (const string &mode : binaryModes)
+            roundTrip("rle_binary", mode, input, label);
+        for (const string &mode : huffmanModes)
+            roundTrip("project", mode, input, label);
+        roundTrip("project", dictOption, input, label, dictOption);
+    }
+}
+
+// A sparse profile written with holes by gen_corpus must come back from
+// rle_binary with the same bytes and its holes, which the reader skips and
+// the writer recreates. Where the file system has no holes there is nothing
+// to keep, and only the bytes are compared
+void testHoles(const string &input)
+{
+    uint64_t size = fs::file_size(input);
+    bool holes = allocatedBytes(input) < size;
+    for (string threads : {"1", "4"})
+    {
+        string packed = work("packed"), output = work("output");
+        fs::remove(packed);
+        fs::remove(output);
+        bool ok = run("rle_binary", "-j " + threads + " -o " + shellQuoted(packed) + " c " + shellQuoted(input)) &&
+                  run("rle_binary", "-j " + threads + " -o " + shellQuoted(output) + " d " + shellQuoted(packed));
+        check(ok && sameBytes(input, output), "rle_binary -j " + threads + " on holes.bin");
+        if (holes)
+            check(ok && allocatedBytes(output) <= allocatedBytes(input) + HOLE_SLACK,
+                  "rle_binary -j " + threads + " keeps the holes of holes.bin");
+    }
+}
+
+// Pack all inputs into an archive of each kind and extract them again
+void testArchives(const vector<string> &inputs)
+{
+    for (string mode : {"a", "s"})
+    {
+        string archive = work("inputs.hufa"), outDir = work("extracted");
+        fs::remove(archive);
+        fs::remove_all(outDir);
+        string files;
+        for (const string &input : inputs)
+            files += " " + shellQuoted(input);
+        bool ok = run("project", "--block-size 64k " + mode + " " + shellQuoted(archive) + files) &&
+                  run("project", "x " + shellQuoted(archive) + " " + shellQuoted(outDir));
+        for (const string &input : inputs)
+        {
+            // Archives keep the path of each file, made relative
+            string name = fs::path(input).relative_path().string();
+            check(ok && sameBytes(input, outDir + "/" + name), "archive mode " + mode + " on " + name);
+        }
+    }
+
+    // An unreadable input fails the whole archive, which is not left behind
+    string archive = work("missing.hufa");
+    fs::remove(archive);
+    check(rejects("project", "a " + shellQuoted(archive) + " " + shellQuoted(inputs[0]) + " " +
+                                 shellQuoted(work("missing.bin"))) &&
+              !fs::exists(archive),
+          "archive of a missing file");
+}
+
+/* Baseline files */
+
+// sample.txt packed by the original tools: text RLE, binary RLE (version 1)
+// and headerless Huffman
+void testBaseline(const string &dataDir)
+{
+    string sample = dataDir + "/baseline/sample.txt", output = work("output");
+    fs::remove(output);
+    check(run("rle", "-o " + shellQuoted(output) + " d " + shellQuoted(sample + ".rle")) && sameBytes(sample, output),
+          "baseline text RLE");
+    fs::remove(output);
+    check(run("rle_binary", "-o " + shellQuoted(output) + " d " + shellQuoted(sample + ".rleb")) && sameBytes(sample, output),
+          "baseline binary RLE");
+    fs::remove(output);
+    check(run("project", "d " + shellQuoted(sample + ".huf") + " " + shellQuoted(output)) && sameBytes(sample, output),
+          "baseline Huffman");
+}
+
+/* Damaged files */
+
+// Compress input, damage the result and expect decompression to fail and
+// leave no output behind
+void expectFailure(const string &tool, const string &options, const string &input, const string &label,
+                   void (*damage)(vector<unsigned char> &))
+{
+    string packed = work("packed"), output = work("output");
+    fs::remove(packed);
+    fs::remove(output);
+    bool ok = tool == "project" ? run(tool, options + " c " + shellQuoted(input) + " " + shellQuoted(packed))
+                                : run(tool, options + " -o " + shellQuoted(packed) + " c " + shellQuoted(input));
+    vector<unsigned char> data = readBytes(packed);
+    damage(data);
+    ok = ok && writeBytes(packed, data);
+    bool rejected = tool == "project" ? rejects(tool, "d " + shellQuoted(packed) + " " + shellQuoted(output))
+                                      : rejects(tool, "-o " + shellQuoted(output) + " d " + shellQuoted(packed));
+    check(ok && rejected && !fs::exists(output), tool + " " + options + " rejects " + label);
+}
+
+void testDamaged(const string &text, const string &runs, const string &sparse, const string &large)
+{
+    auto cutTail = [](vector<unsigned char> &data) { data.resize(data.size() - 16); };
+    auto cutLast = [](vector<unsigned char> &data) { data.pop_back(); };
+    auto badVersion = [](vector<unsigned char> &data) { data[4] = 0xFF; };
+    auto extraChunk = [](vector<unsigned char> &data) { data[data.size() - 4]++; };
+    auto danglingCount = [](vector<unsigned char> &data) { data.push_back('7'); };
+    // The first block's table starts at byte 18 of a file without dictionary,
+    // BWT or static table: [u16 size] then (symbol, code length) pairs
+    auto longCode = [](vector<unsigned char> &data) { data[21] = 200; };
+    auto overfullTable = [](vector<unsigned char> &data) { data[21] = data[23] = data[25] = 1; };
+    // One code of 00, so a 1 bit leads nowhere
+    auto incompleteTable = [](vector<unsigned char> &data)
+    {
+        data[18] = 1;
+        data[19] = 0;
+        data[21] = 2;
+    };
+
+    expectFailure("project", "", text, "a truncated file", cutTail);
+    expectFailure("project", "--bwt --block-size 64k", text, "a truncated file", cutTail);
+    expectFailure("project", "", text, "an unknown version", badVersion);
+    expectFailure("project", "--no-static-tables", text, "a code longer than 63 bits", longCode);
+    expectFailure("project", "--no-static-tables", text, "an over-full code table", overfullTable);
+    expectFailure("project", "--no-static-tables", text, "an incomplete code table", incompleteTable);
+    expectFailure("rle_binary", "-j 4", large, "a truncated container", cutLast);
+    expectFailure("rle_binary", "-j 4", large, "a wrong chunk count", extraChunk);
+    expectFailure("rle_binary", "-j 1 --format 5", runs, "a run cut before its byte", cutLast);
+    expectFailure("rle", "", sparse, "a count without a character", danglingCount);
+
+    // An archive missing its trailer
+    string archive = work("damaged.hufa"), outDir = work("extracted");
+    fs::remove(archive);
+    fs::remove_all(outDir);
+    bool ok = run("project", "a " + shellQuoted(archive) + " " + shellQuoted(text));
+    vector<unsigned char> data = readBytes(archive);
+    cutTail(data);
+    ok = ok && writeBytes(archive, data);
+    check(ok && rejects("project", "x " + shellQuoted(archive) + " " + shellQuoted(outDir)),
+          "project rejects a truncated archive");
+
+    // A BWT block of nothing but RUNB symbols, whose zero run doubles with
+    // every symbol: one block of 16 bytes with a one-entry table that gives
+    // RUNB the code 0, then 80 zero bits
+    string crafted = work("zero-runs.huf"), output = work("output");
+    fs::remove(output);
+    vector<unsigned char> zeroRuns = {'H', 'U', 'F', 'Z', 4, 0, 0, 0, 0, // Magic, version, no dictionary
+                                      0x01, 16, 0, 0, 0, 0, 0, 0, 0,     // BWT block, raw size, primary
+                                      80, 0, 0, 0, 1, 0, 1, 1};          // Bit length, table {RUNB: 1 bit}
+    zeroRuns.resize(zeroRuns.size() + 10, 0);
+    ok = writeBytes(crafted, zeroRuns);
+    check(ok && rejects("project", "d " + shellQuoted(crafted) + " " + shellQuoted(output)) && !fs::exists(output),
+          "project rejects an unbounded zero run");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4)
+    {
+        cerr << "Usage: " << argv[0] << " <bin dir> <testdata dir> <work dir>\n";
+        return 2;
+    }
+    binDir = argv[1];
+    string dataDir = argv[2];
+    workDir = argv[3];
+    fs::create_directories(workDir);
+
+    vector<string> inputs;
+    for (const char *profile : CORPUS_PROFILES)
+    {
+        vector<unsigned char> data;
+        string file = work(string(profile) + ".bin");
+        if (!generateCorpus(profile, PROFILE_SIZE, SEED, data) || !writeBytes(file, data))
+        {
+            cerr << "Error: Cannot write corpus: " << file << endl;
+            return 1;
+        }
+        inputs.push_back(file);
+    }
+
+    // A dictionary trained on other text than it is tested with, a
+    // compressible input large enough for a multi-chunk container, and a
+    // sparse one of the same size with holes
+    vector<unsigned char> data;
+    string sample = work("dict-sample.bin"), dictionary = work("text.hufd"), large = work("large.bin");
+    string holes = work("holes.bin");
+    if (!run("gen_corpus", "--size " + to_string(LARGE_SIZE) + " --seed " + to_string(SEED) + " sparse " +
+                               shellQuoted(holes)) ||
+        !generateCorpus("text", PROFILE_SIZE, SEED + 1, data) || !writeBytes(sample, data) ||
+        !run("project", "train " + shellQuoted(dictionary) + " " + shellQuoted(sample)) ||
+        !generateCorpus("runs", LARGE_SIZE, SEED, data) || !writeBytes(large, data))
+    {
+        cerr << "Error: Cannot prepare test files in " << workDir << endl;
+        return 1;
+    }
+
+    testProfiles(inputs, dictionary);
+    roundTrip("rle", "", large, "large.bin");
+    roundTrip("rle_binary", "-j 4", large, "large.bin");
+    testHoles(holes);
+    testArchives(inputs);
+    testBaseline(dataDir);
+    testDamaged(inputs[3], inputs[0], inputs[4], large);
+
+    cout << checks - failures << " of " << checks << " checks passed" << endl;
+    return failures == 0 ? 0 : 1;
+}
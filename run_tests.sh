@@ -0,0 +1,14 @@
+#!/bin/sh
+# Build the tools and the round-trip driver, then run it (see roundtrip_test.cpp).
+# Binaries and test files go to $BUILD_DIR (default build/), and CXX picks the compiler.
+set -e
+cd "$(dirname "$0")"
+BUILD_DIR=${BUILD_DIR:-build}
+CXX=${CXX:-g++}
+CXXFLAGS="-O2 -std=c++17 -Wall -Wextra -pthread"
+
+mkdir -p "$BUILD_DIR/bin"
+for tool in rle rle_binary project gen_corpus roundtrip_test; do
+    $CXX $CXXFLAGS "$tool.cpp" -o "$BUILD_DIR/bin/$tool"
+done
+"$BUILD_DIR/bin/roundtrip_test" "$BUILD_DIR/bin" testdata "$BUILD_DIR/roundtrip"
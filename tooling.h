@@ -0,0 +1,232 @@
+#ifndef TOOLING_H
+#define TOOLING_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+/*
+ * Command-line helpers shared by the tools
+ *
+ * Size arguments, removing failed outputs, peak memory reporting, the worker
+ * pool and --trace output. A trace records spans of work on the thread that
+ * ran them and is written in the Chrome trace-event format that
+ * chrome://tracing and Perfetto open.
+ */
+
+// Parse a byte count with an optional k/m/g suffix; 0 on error
+inline size_t parseSize(const std::string &text)
+{
+    char *end = nullptr;
+    unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str())
+        return 0;
+    std::string suffix = end;
+    if (suffix == "k" || suffix == "K")
+        value <<= 10;
+    else if (suffix == "m" || suffix == "M")
+        value <<= 20;
+    else if (suffix == "g" || suffix == "G")
+        value <<= 30;
+    else if (!suffix.empty())
+        return 0;
+    return static_cast<size_t>(value);
+}
+
+// Remove the partial output of a failed run; always false
+inline bool discardOutput(std::ofstream &out, const std::string &outputFile)
+{
+    out.close();
+    std::error_code ec;
+    std::filesystem::remove(outputFile, ec);
+    return false;
+}
+
+// Peak resident set size of the process in bytes, 0 where unknown
+inline uint64_t peakMemory()
+{
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Fixed-size pool of worker threads running submitted tasks in FIFO order
+class ThreadPool
+{
+public:
+    explicit ThreadPool(size_t threads)
+    {
+        for (size_t i = 0; i < threads; i++)
+            workers.emplace_back([this]
+                                 { run(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread &t : workers)
+            t.join();
+    }
+
+    template <typename F>
+    auto submit(F f) -> std::future<decltype(f())>
+    {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+        std::future<decltype(f())> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.push([task]
+                       { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cv.wait(lock, [this]
+                        { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+// Spans of a run in memory, written out as trace-event JSON at the end. Each
+// span belongs to a unit of work ("chunk" or "block"), which names its
+// category and argument
+class Trace
+{
+public:
+    // With firstIsMain, the first thread seen is named "main" and the others
+    // "worker N"; otherwise all are "thread N"
+    explicit Trace(const char *unit = "chunk", bool firstIsMain = false) : unit(unit), firstIsMain(firstIsMain) {}
+
+    // Record a span of a unit on the calling thread; safe to call from any thread
+    void span(const char *name, uint64_t index, std::chrono::steady_clock::time_point start,
+              std::chrono::steady_clock::time_point end)
+    {
+        std::lock_guard<std::mutex> lock(m);
+        size_t tid = std::find(threads.begin(), threads.end(), std::this_thread::get_id()) - threads.begin();
+        if (tid == threads.size())
+            threads.push_back(std::this_thread::get_id());
+        events.push_back({name, index, tid, micros(start), micros(end) - micros(start)});
+    }
+
+    bool write(const std::string &file)
+    {
+        std::ofstream out(file);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        for (size_t t = 0; t < threads.size(); t++)
+        {
+            std::string name = !firstIsMain ? "thread " + std::to_string(t)
+                               : t          ? "worker " + std::to_string(t)
+                                            : std::string("main");
+            out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << t
+                << ", \"args\": {\"name\": \"" << name << "\"}},\n";
+        }
+        for (size_t i = 0; i < events.size(); i++)
+        {
+            const Event &e = events[i];
+            out << "{\"name\": \"" << e.name << "\", \"cat\": \"" << unit << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+                << e.tid << ", \"ts\": " << e.ts << ", \"dur\": " << e.dur << ", \"args\": {\"" << unit
+                << "\": " << e.index << "}}" << (i + 1 < events.size() ? ",\n" : "\n");
+        }
+        out << "]}\n";
+        return out.good();
+    }
+
+private:
+    struct Event
+    {
+        const char *name;
+        uint64_t index;
+        size_t tid;
+        uint64_t ts;
+        uint64_t dur;
+    };
+
+    // Microseconds since the trace began
+    uint64_t micros(std::chrono::steady_clock::time_point t) const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t - origin).count();
+    }
+
+    const char *unit;
+    bool firstIsMain;
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    std::mutex m;
+    std::vector<Event> events;
+    std::vector<std::thread::id> threads; // Index is the trace thread ID
+};
+
+inline Trace *activeTrace = nullptr; // Set by --trace, once in main before any work starts
+
+// Records the time until it goes out of scope as a span, if a trace is active
+class TraceSpan
+{
+public:
+    TraceSpan(const char *name, uint64_t index) : name(name), index(index)
+    {
+        if (activeTrace)
+            start = std::chrono::steady_clock::now();
+    }
+
+    ~TraceSpan()
+    {
+        if (activeTrace)
+            activeTrace->span(name, index, start, std::chrono::steady_clock::now());
+    }
+
+private:
+    const char *name;
+    uint64_t index;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif